@@ -10,7 +10,13 @@
 
 
 #define IMAGEFS_PATH_META				"/meta/"
-#define IMAGEFS_DFU_STREAM_BUFSIZE		(128) /* minimum size = PACKFS_MIN_STREAMSIZE */
+#ifdef CONFIG_IMAGEFS_DFU_STREAM_BUFSIZE
+#define IMAGEFS_DFU_STREAM_BUFSIZE		(CONFIG_IMAGEFS_DFU_STREAM_BUFSIZE) /* minimum size = PACKFS_MIN_STREAMSIZE */
+#else
+#define IMAGEFS_DFU_STREAM_BUFSIZE		(4096)
+#endif
+#define IMAGEFS_DFU_CHUNKSIZE			(0) /* 0 = CONFIG_PACKFS_PROCESS_CHUNKSIZE */
+#define IMAGEFS_VERIFY_CHUNKSIZE		(0) /* 0 = CONFIG_PACKFS_PROCESS_CHUNKSIZE */
 
 typedef struct {
 	bool (*namegen)(char * path, size_t pathlen, const char * projname, const char * projversion);
@@ -25,7 +31,7 @@ typedef struct {
 typedef struct {
 	const char * base_path;
 	const char * prefix_path;
-//	size_t max_files;
+	size_t max_files;			/* Max open files on this mount, 0 for CONFIG_PACKFS_MAX_FILES */
 	bool skip_verify;
 	bool full_verify;
 	imagefs_filename_t filename;
@@ -4,7 +4,11 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 #include <esp_err.h>
+#ifdef CONFIG_PACKFS_PARTITION_SUPPORT
+#include <esp_partition.h>
+#endif
 
 //#define CONFIG_PACKFS_PROCESS_SUPPORT
 //#define CONFIG_PACKFS_STREAM_SUPPORT
@@ -16,7 +20,14 @@
 #define PACKFS_MAX_INDEXPATH	(128)
 //#define PACKFS_MAX_NUMENTRIES	(30)
 
+#ifdef CONFIG_PACKFS_LZO_MAXBLOCK
+#define PACKFS_MAX_LZOBLOCK		(CONFIG_PACKFS_LZO_MAXBLOCK)
+#else
 #define PACKFS_MAX_LZOBLOCK		(2048)
+#endif
+#define PACKFS_HEATSHRINK_WINDOW	(8)
+#define PACKFS_HEATSHRINK_LOOKAHEAD	(4)
+#define PACKFS_INPLACE_MARGIN(blocksize)	((blocksize) / 16 + 64 + 3)	/* Slack past blocksize for in-place decode, lzo1x worst case */
 #define PACKFS_MIN_STREAMSIZE	(128) /* minimum size = max(sizeof(packfs_entry_t), sizeof(packfs_meta_t)) */
 // TODO - figure out min streamsize with updated meta_t
 //#define PACKFS_HASHSIZE			(32)
@@ -30,7 +41,7 @@ typedef packfs_sha256_t packfs_hmac_t;
 typedef struct __packfs_packed {
 	uint16_t magic;
 	uint8_t version;
-	uint8_t _reserved;
+	uint8_t flags;
 	uint32_t metasize;
 	uint32_t indexsize;
 	packfs_sha256_t metahash;
@@ -39,6 +50,46 @@ typedef struct __packfs_packed {
 	packfs_hmac_t securehmac;
 } packfs_header_t;
 
+#define PH_SORTEDINDEX	(0x01)		/* Index entries are sorted by path */
+#define PH_HASHTABLE	(0x02)		/* Path hash table section follows the index */
+#define PH_COMPACTINDEX	(0x04)		/* Index is packfs_cindex_t, packfs_centry_t records, then a front-coded path table */
+#define PH_DIRTABLE		(0x08)		/* Directory range table section follows the index, needs PH_SORTEDINDEX */
+#define PH_BLOOMFILTER	(0x10)		/* Bloom filter section over entry paths follows the index */
+#define PH_SIZETABLE	(0x20)		/* Entry size table section follows the index */
+
+typedef struct __packfs_packed {
+	uint8_t type;
+	uint32_t size;
+} packfs_section_t;
+
+/* Directory is the first pathlen characters (including the trailing '/') of entry first,
+   count entries below it are contiguous in the sorted index. Records are sorted by directory path */
+typedef struct __packfs_packed {
+	uint32_t first;
+	uint32_t count;
+	uint16_t pathlen;
+} packfs_dirrange_t;
+
+#define PACKFS_HASHSLOT_EMPTY	(0xffffffff)
+typedef struct __packfs_packed {
+	uint32_t hash;
+	uint32_t index;
+} packfs_hashslot_t;
+
+/* Bloom filter header, numbits / 8 bytes of filter follow. numbits is a power of two, probe i
+   tests bit (h1 + i * h2) & (numbits - 1) where h1 is the path hash and h2 is h1 rotated by 16, ored with 1 */
+typedef struct __packfs_packed {
+	uint8_t numprobes;
+	uint32_t numbits;
+} packfs_bloom_t;
+
+/* Size table has one record per index entry, in index order. size is the uncompressed length,
+   blocksize is the compression block size or 0 for stored entries and blocks too big to record */
+typedef struct __packfs_packed {
+	uint32_t size;
+	uint16_t blocksize;
+} packfs_sizeinfo_t;
+
 #define PF_SECURED  (0x1000)
 #define PF_CHANGED  (0x0001)
 #define PF_NVM      (0x0010)
@@ -70,7 +121,13 @@ typedef struct __packfs_packed {
 
 #define PFT_REG     (0x01)
 #define PFT_IMG     (0x02)
+#define PF_LZOWIDE  (0x08)		/* LZO header blocksize and block lengths are uint32_t, for blocks over 64 KB */
 #define PF_LZO      (0x10)
+#define PF_LZOTABLE (0x20)		/* LZO header is followed by a uint32_t offset per block, relative to the entry start */
+#define PF_CODEC    (0xC0)		/* Block codec of a PF_LZO entry, one of PF_CODEC_* */
+#define PF_CODEC_LZO		(0x00)
+#define PF_CODEC_LZ4		(0x40)	/* LZ4 block format, no frame */
+#define PF_CODEC_HEATSHRINK	(0x80)	/* Heatshrink with PACKFS_HEATSHRINK_WINDOW/LOOKAHEAD */
 typedef struct __packfs_packed {
 	uint8_t flags;
 	uint32_t offset;
@@ -79,6 +136,20 @@ typedef struct __packfs_packed {
 	char path[PACKFS_MAX_INDEXPATH];
 } packfs_entry_t;
 
+/* Path table entry is { uint8_t shared, uint8_t suffixlen, char suffix[suffixlen] }, where shared
+   is the prefix length taken from the previous path. Builder restarts (shared = 0) every 16 entries */
+typedef struct __packfs_packed {
+	uint32_t numentries;
+} packfs_cindex_t;
+
+typedef struct __packfs_packed {
+	uint8_t flags;
+	uint32_t offset;
+	uint32_t length;
+	packfs_sha256_t entryhash;
+	uint32_t name;
+} packfs_centry_t;
+
 #ifdef CONFIG_PACKFS_PROCESS_SUPPORT
 typedef enum {
 	PS_OK,
@@ -119,8 +190,19 @@ typedef void * packfs_stream_t;
 typedef struct {
 	const char * base_path;
 	const char * prefix_path;
+	size_t max_files;			/* Max open files on this mount, 0 for CONFIG_PACKFS_MAX_FILES */
 } packfs_conf_t;
 
+/* Storage backend for pack files. readat may be called from several tasks at once on the same handle,
+   map returns a pointer to length bytes at offset that stays valid until close, or NULL if not mappable */
+typedef struct {
+	void * (*open)(const char * path, void * ud);
+	void (*close)(void * handle);
+	bool (*stat)(const char * path, void * ud, uint32_t * out_length, time_t * out_mtime);
+	bool (*readat)(void * handle, uint32_t offset, void * buffer, size_t length);
+	const void * (*map)(void * handle, uint32_t offset, size_t length);	/* Optional */
+} packfs_backend_t;
+
 #define PIOCTL_METACOUNT		(1)
 #define PIOCTL_METAREAD			(2)
 #define PIOCTL_METAFIND			(3)
@@ -131,21 +213,51 @@ typedef struct {
 
 #define PIOCTL_ENTRYCURRENT		(7)
 #define PIOCTL_ENTRYHASH		(8)
+#define PIOCTL_ENTRYMAP			(9)		/* (const void ** out_data, size_t * out_length), EFTYPE if compressed, ENOTSUP if the backend can't map */
+#define PIOCTL_READAHEAD		(10)	/* (int enable), EFTYPE if not compressed, ENOTSUP without CONFIG_PACKFS_LZO_READAHEAD */
 
 esp_err_t packfs_vfs_register(packfs_conf_t * config);
 
+/* Map the open entry on fd without copying, the pointer stays valid until fd is closed */
+int packfs_entrymap(int fd, const void ** out_data, size_t * out_length);
+
+/* Decode the next block of a compressed entry in the background while the current one is read */
+int packfs_readahead(int fd, bool enable);
+
+#ifdef CONFIG_PACKFS_LZO_SUPPORT
+typedef struct {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t evictions;
+} packfs_blockcache_stats_t;
+
+/* Counters of the shared decompressed block cache, all zero if CONFIG_PACKFS_LZO_BLOCKCACHE is 0 */
+void packfs_blockcache_stats(packfs_blockcache_stats_t * out_stats, bool reset);
+#endif
+
+/* Backing paths are matched after prefix_path is applied, unregistered paths use stdio */
+esp_err_t packfs_backend_register(const char * path, const packfs_backend_t * backend, void * ud);
+esp_err_t packfs_backend_register_memory(const char * path, const void * data, size_t length);
+#ifdef CONFIG_PACKFS_PARTITION_SUPPORT
+esp_err_t packfs_backend_register_partition(const char * path, const esp_partition_t * partition);
+#endif
+
 #ifdef CONFIG_PACKFS_PROCESS_SUPPORT
-esp_err_t packfs_process_fromfile(const char * filepath, packfs_proccb_t * cbs, void * userdata);
+/* chunksize is how much entry data is read and handed to callbacks at a time, 0 for CONFIG_PACKFS_PROCESS_CHUNKSIZE */
+esp_err_t packfs_process_fromfile(const char * filepath, size_t chunksize, packfs_proccb_t * cbs, void * userdata);
 void packfs_process_free(packfs_process_t proc);
 #ifdef CONFIG_PACKFS_STREAM_SUPPORT
 packfs_status_t packfs_stream_process(packfs_stream_t stream);
 ssize_t packfs_stream_load(packfs_stream_t stream, void * data, size_t length);
+/* Receive straight into the stream, reserve hands out contiguous free space and commit marks length bytes of it filled */
+packfs_status_t packfs_stream_reserve(packfs_stream_t stream, void ** out_data, size_t * out_length);
+packfs_status_t packfs_stream_commit(packfs_stream_t stream, size_t length);
 packfs_status_t packfs_stream_loadeof(packfs_stream_t stream);
 packfs_status_t packfs_stream_flush(packfs_stream_t stream);
 packfs_status_t packfs_stream_loadandprocess(packfs_stream_t stream, void * data, size_t length);
 packfs_status_t packfs_stream_loadeofandflush(packfs_stream_t stream);
 
-esp_err_t packfs_stream_tofile(FILE * fp, size_t bufsize, packfs_proccb_t * cbs, void * userdata, packfs_stream_t * out_stream);
+esp_err_t packfs_stream_tofile(FILE * fp, size_t bufsize, size_t chunksize, packfs_proccb_t * cbs, void * userdata, packfs_stream_t * out_stream);
 esp_err_t packfs_stream_tofile_close(packfs_stream_t stream);
 #endif
 #endif
@@ -4,101 +4,294 @@ from json import loads, dump
 from re import match, search
 from lzo import compress
 from hashlib import sha256
-from crcmod.predefined import mkCrcFun
+from binascii import crc32
 
 PACKFS_MAGIC = 0x12fc
-PACKFS_VERSION = 0x01
+PACKFS_VERSION = 0x02
 PACKFS_LZOBLOCK = 1024
 #PACKFS_LZOBLOCK = 1024*2
 PACKFS_LZOLEVEL = 9
 
-PACKFS_SIZE_HEADER = calcsize('<HBHHII32BH')
-PACKFS_SIZE_META = calcsize('<B32s64s')
-PACKFS_SIZE_INDEX = calcsize('<IIB64s')
+PACKFS_SIZE_HEADER = calcsize('<HBBII32s32sI32s')
+PACKFS_SIZE_META = calcsize('<HBHI64s')
+PACKFS_SIZE_INDEX = calcsize('<BII32s128s')
+
+PH_SORTEDINDEX = 0x01
+PH_HASHTABLE = 0x02
+PH_COMPACTINDEX = 0x04
+PH_DIRTABLE = 0x08
+PH_BLOOMFILTER = 0x10
+PH_SIZETABLE = 0x20
+
+PACKFS_FRONTCODE_RESTART = 16
+
+PACKFS_HASHSLOT_EMPTY = 0xffffffff
+PACKFS_BLOOM_BITSPERENTRY = 10
+PACKFS_BLOOM_PROBES = 7
 
 PT_REG = 0x01
 PT_IMG = 0x02
+PF_LZOWIDE = 0x08
 PF_LZO = 0x10
+PF_LZOTABLE = 0x20
+PF_CODEC_LZO = 0x00
+PF_CODEC_LZ4 = 0x40
+PF_CODEC_HEATSHRINK = 0x80
 
-crc16 = mkCrcFun('crc-16-genibus')
+PACKFS_HEATSHRINK_WINDOW = 8
+PACKFS_HEATSHRINK_LOOKAHEAD = 4
 
+MT_STRING = 0x60
 
-def mkheader(metasize, indexsize, regentrysize, imgentrysize, sig):
-    d = pack('<HBHHII', PACKFS_MAGIC, PACKFS_VERSION, metasize, indexsize, regentrysize, imgentrysize) + sig
-    return d + pack('<H', crc16(d))
+
+def mkheader(flags, metadata, indexdata, sectiondata):
+    d = pack('<HBBII32s32s', PACKFS_MAGIC, PACKFS_VERSION, flags, len(metadata), len(indexdata), sha256(metadata).digest(), sha256(indexdata + sectiondata).digest())
+    return d + pack('<I32s', crc32(d) & 0xffffffff, b'')
 
 
 def mkmeta(flags, key, value):
-    return pack('<B32s64s', flags, key.encode('utf-8'), value.encode('utf-8'))
+    v = value.encode('utf-8') + b'\0'
+    return pack('<HBHI64s', flags, MT_STRING, 0, len(v), key.encode('utf-8')) + v
+
+
+def mksection(type, data):
+    return pack('<BI', type, len(data)) + data
+
+
+def pathhash(name):
+    h = 0x811c9dc5
+    for c in name:
+        h = ((h ^ c) * 0x01000193) & 0xffffffff
+    return h
+
+
+def hashslots(count):
+    n = 1
+    while n < count * 2: n *= 2
+    return n
+
+
+def mkhashtable(names):
+    slots = [(0, PACKFS_HASHSLOT_EMPTY)] * hashslots(len(names))
+    mask = len(slots) - 1
+    for i, name in enumerate(names):
+        h = pathhash(name)
+        s = h & mask
+        while slots[s][1] != PACKFS_HASHSLOT_EMPTY: s = (s + 1) & mask
+        slots[s] = (h, i)
+    return mksection(PH_HASHTABLE, b''.join([pack('<II', h, i) for h, i in slots]))
+
+
+def bloombits(count):
+    n = 64
+    while n < count * PACKFS_BLOOM_BITSPERENTRY: n *= 2
+    return n
+
+
+def mkbloomfilter(names):
+    numbits = bloombits(len(names))
+    bits = bytearray(numbits // 8)
+    for name in names:
+        h = pathhash(name)
+        step = (((h << 16) | (h >> 16)) & 0xffffffff) | 1
+        for i in range(PACKFS_BLOOM_PROBES):
+            b = h & (numbits - 1)
+            bits[b // 8] |= 1 << (b % 8)
+            h = (h + step) & 0xffffffff
+    return mksection(PH_BLOOMFILTER, pack('<BI', PACKFS_BLOOM_PROBES, numbits) + bytes(bits))
+
+
+def mksizetable(sizes):
+    return mksection(PH_SIZETABLE, b''.join([pack('<IH', size, blocksize) for size, blocksize in sizes]))
+
+
+def dirprefixes(names):
+    return sorted(set([n[:i + 1] for n in names for i in range(len(n)) if n[i:i + 1] == b'/']))
+
+
+def mkdirtable(names):
+    ranges = b''
+    for prefix in dirprefixes(names):
+        first = next(i for i, n in enumerate(names) if n.startswith(prefix))
+        count = len([n for n in names if n.startswith(prefix)])
+        ranges += pack('<IIH', first, count, len(prefix))
+    return mksection(PH_DIRTABLE, ranges)
 
 
 def etype(flags):
     t = ''
-    if flags & PF_LZO: t += 'lzo compressed '
+    if flags & PF_LZO: t += '{} compressed '.format(CODECS[flags & 0xC0][0])
     if flags & PT_IMG: t += 'image file'
     elif flags & PT_REG: t += 'regular file'
     else: t += 'unknown'
     return t
 
 
-def mkindex(offset, length, flags, name):
-    return pack('<IIB64s', offset, length, flags, name.encode('utf-8'))
-
-
 def mkimghash(data):
     return sha256(data).digest()
 
 
+def mkindex(offset, length, flags, name, hash):
+    return pack('<BII32s128s', flags, offset, length, hash, name.encode('utf-8'))
+
+
+def mkcompactindex(index):
+    records = []
+    strtab = b''
+    prev = b''
+    for i, (name, offset, length, flags, hash) in enumerate(index):
+        shared = 0
+        if i % PACKFS_FRONTCODE_RESTART != 0:
+            while shared < min(len(prev), len(name), 255) and prev[shared] == name[shared]: shared += 1
+        records.append(pack('<BII32sI', flags, offset, length, hash, len(strtab)))
+        strtab += pack('<BB', shared, len(name) - shared) + name[shared:]
+        prev = name
+    return pack('<I', len(index)) + b''.join(records) + strtab
+
+
 def lzopercent(a, b):
     return "incompressible" if a == b else "{}%".format(round(-100.0+100.0*b/a, 2))
 
 
-def mklzoentry(blocksize, data):
-    d = [pack('<IH', len(data), blocksize)]
+def lzocompress(data):
+    return compress(data, PACKFS_LZOLEVEL, False)
+
+
+def lz4compress(data):
+    from lz4.block import compress as lz4compress
+    return lz4compress(data, mode='high_compression', store_size=False)
+
+
+def heatshrinkcompress(data):
+    from heatshrink2 import compress as hscompress
+    return hscompress(data, window_sz2=PACKFS_HEATSHRINK_WINDOW, lookahead_sz2=PACKFS_HEATSHRINK_LOOKAHEAD)
+
+
+def inplacemargin(blocksize):
+    return blocksize // 16 + 64 + 3
+
+
+def hsinplace(blocksize, x, n):
+    # Walk the heatshrink stream and make sure no output byte lands on unread input when x sits
+    # at the tail of a blocksize + margin buffer. lzo and lz4 are within the margin by design
+    tail = blocksize + inplacemargin(blocksize) - len(x)
+    bit, out = 0, 0
+    def take(count):
+        nonlocal bit
+        v = 0
+        for _ in range(count):
+            v = (v << 1) | ((x[bit // 8] >> (7 - bit % 8)) & 1)
+            bit += 1
+        return v
+    while out < n:
+        if take(1):
+            take(8)
+            count = 1
+        else:
+            take(PACKFS_HEATSHRINK_WINDOW)
+            count = take(PACKFS_HEATSHRINK_LOOKAHEAD) + 1
+        if out + count > tail + bit // 8: return False
+        out += count
+    return True
+
+
+CODECS = {
+    PF_CODEC_LZO: ('lzo', lzocompress),
+    PF_CODEC_LZ4: ('lz4', lz4compress),
+    PF_CODEC_HEATSHRINK: ('heatshrink', heatshrinkcompress),
+}
+
+
+def lzowide(blocksize):
+    # Blocks over 64 KB need 32-bit header blocksize and block lengths
+    return blocksize > 0xffff
+
+
+def mklzoentry(blocksize, data, codec=PF_CODEC_LZO):
+    lenfmt, headfmt = ('<I', '<II') if lzowide(blocksize) else ('<H', '<IH')
+    d = []
     chunks = [data[i:i + blocksize] for i in range(0, len(data), blocksize)]
     for i in range(len(chunks)):
         c = chunks[i]
-        x = compress(c, PACKFS_LZOLEVEL, False)
+        x = CODECS[codec][1](c)
         if len(x) >= len(c): x = c
+        elif codec == PF_CODEC_HEATSHRINK and not hsinplace(blocksize, x, len(c)): x = c
         print("- Compressing block {}... {} -> {} bytes ({})".format(i, len(c), len(x), lzopercent(len(c), len(x))))
-        d.extend([pack('<H', len(x)), x])
-    e = b''.join(d)
+        d.append(pack(lenfmt, len(x)) + x)
+
+    # Block offset table lets readers seek straight to any block
+    offset = calcsize(headfmt) + len(d) * calcsize('<I')
+    table = []
+    for b in d:
+        table.append(pack('<I', offset))
+        offset += len(b)
+    e = pack(headfmt, len(data), blocksize) + b''.join(table) + b''.join(d)
     print("- Overall compression {} -> {} bytes ({})".format(len(data), len(e), lzopercent(len(data), len(e))))
     return e
 
 
-def mkpack(meta, entries, strip=False):
-    metasize = len(meta) * PACKFS_SIZE_META
-    indexsize = len(entries) * PACKFS_SIZE_INDEX
-    offset = PACKFS_SIZE_HEADER + metasize + indexsize
+def mkpack(meta, entries, strip=False, blocksize=PACKFS_LZOBLOCK):
     print("Adding meta keys {}".format(', '.join(map(lambda x: "[{}]{}={}".format(hex(x[0]), x[1], x[2]), meta))))
-    
-    d = {'head': [mkmeta(m[0], m[1], m[2]) for m in meta], 'reg': [], 'img': []}
+    metadata = b''.join([mkmeta(m[0], m[1], m[2]) for m in meta])
+
+    # Index is sorted by path so lookups can binary search, offsets are filled in below
+    for e in entries:
+        if len(e['name'].encode('utf-8')) > 127: raise ValueError("Entry path too long: {}".format(e['name']))
+    names = sorted([e['name'].encode('utf-8') for e in entries])
+    flags = PH_SORTEDINDEX | PH_COMPACTINDEX
+    indexsize = len(mkcompactindex([(n, 0, 0, 0, b'') for n in names]))
+    sectionsize = 0
+    if len(entries) > 0:
+        flags |= PH_HASHTABLE
+        sectionsize += calcsize('<BI') + hashslots(len(entries)) * calcsize('<II')
+    if len(dirprefixes(names)) > 0:
+        flags |= PH_DIRTABLE
+        sectionsize += calcsize('<BI') + len(dirprefixes(names)) * calcsize('<IIH')
+    if len(entries) > 0:
+        flags |= PH_BLOOMFILTER
+        sectionsize += calcsize('<BI') + calcsize('<BI') + bloombits(len(entries)) // 8
+    flags |= PH_SIZETABLE
+    sectionsize += calcsize('<BI') + len(entries) * calcsize('<IH')
+    offset = PACKFS_SIZE_HEADER + len(metadata) + indexsize + sectionsize
+
+    d = {'index': {}, 'sizes': {}, 'reg': [], 'img': []}
     reg = sorted(filter(lambda e: e['flags'] & PT_REG, entries), key=lambda e: len(e['data']))
     img = sorted(filter(lambda e: e['flags'] & PT_IMG, entries), key=lambda e: len(e['data']))
 
     def mkentry(entry, section, offset):
         print("Adding {} entry {}".format(etype(entry['flags']), entry['name']))
+        name = entry['name'].encode('utf-8')
+        d['sizes'][name] = (len(entry['data']), blocksize if entry['flags'] & PF_LZO and not lzowide(blocksize) else 0)
         if entry['flags'] & PT_IMG: entry['hash'] = mkimghash(entry['data'])
-        if entry['flags'] & PF_LZO: entry['data'] = mklzoentry(PACKFS_LZOBLOCK, entry['data'])
+        if entry['flags'] & PF_LZO:
+            entry['data'] = mklzoentry(blocksize, entry['data'], entry['flags'] & 0xC0)
+            entry['flags'] |= PF_LZOTABLE | (PF_LZOWIDE if lzowide(blocksize) else 0)
         if entry['flags'] & PT_IMG: entry['data'] = entry['hash'] + entry['data']
         length = len(entry['data'])
-        d['head'].append(mkindex(offset, length, entry['flags'], entry['name']))
+        d['index'][name] = (name, offset, length, entry['flags'], sha256(entry['data']).digest())
         d[section].append(entry['data'])
         print("- Entry offset {} length {}".format(offset, length))
         return length
 
+    # Entry data is laid out smallest first, image entries last so they can be stripped
     for r in reg: offset += mkentry(r, 'reg', offset)
     for i in img: offset += mkentry(i, 'img', offset)
 
-    sig = sha256()
-    for x in d['head'] + d['reg']: sig.update(x)
+    index = [d['index'][n] for n in names]
+    indexdata = mkcompactindex(index)
+    assert len(indexdata) == indexsize
+
+    # Optional sections follow the index in header flag bit order
+    sectiondata = b''
+    if flags & PH_HASHTABLE: sectiondata += mkhashtable(names)
+    if flags & PH_DIRTABLE: sectiondata += mkdirtable(names)
+    if flags & PH_BLOOMFILTER: sectiondata += mkbloomfilter(names)
+    if flags & PH_SIZETABLE: sectiondata += mksizetable([d['sizes'][n] for n in names])
+    assert len(sectiondata) == sectionsize
 
     regdata = b''.join(d['reg'])
     imgdata = b''.join(d['img'])
-    d['head'].insert(0, mkheader(metasize, indexsize, len(regdata), len(imgdata), sig.digest()))
-
-    filedata = b''.join(d['head']) + regdata
+    filedata = mkheader(flags, metadata, indexdata, sectiondata) + metadata + indexdata + sectiondata + regdata
     if not strip: filedata += imgdata
     print("=> Total filesize {} bytes".format(len(filedata)))
     return filedata
@@ -112,6 +305,7 @@ def main():
     parser.add_argument('-f', '--file', action='append', type=FileType('r'), help="Read manifest json file")
     parser.add_argument('-i', '--index', action='store', type=FileType('w'), help="Output manifest index in json format")
     parser.add_argument('-t', '--template', action='append', type=str, help="Replace template variables in files specified by name=value. Replaces file contents of the type {{name}}.")
+    parser.add_argument('-b', '--blocksize', action='store', type=int, default=PACKFS_LZOBLOCK, help="Compression block size in bytes, must not exceed the reader's CONFIG_PACKFS_LZO_MAXBLOCK")
     parser.add_argument('-o', '--output', action='store', type=FileType('wb'), help="Output filename of the generated packfile")
 
     args = parser.parse_args()
@@ -138,18 +332,24 @@ def main():
         if not m: raise ValueError("Bad parse key=value: {}".format(arg))
         return parsejsonmeta({'name': m.group(1), 'value': m.group(2)})
 
+    def parsecodec(flags):
+        # Any codec name implies a compressed entry, plain "lzo" keeps the original format
+        for codec, (name, _) in CODECS.items():
+            if name in flags: return PF_LZO | codec
+        return 0x0
+
     def parsejsonentry(obj):
         with open(obj['path'], 'rb') as fp:
             data = fp.read()
         return {
             'name': obj['name'],
-            'flags': (PF_LZO if "lzo" in obj['flags'] else 0x0) | (PT_IMG if "img" in obj['flags'] else 0x00) | (PT_REG if "reg" in obj['flags'] else 0x00),
+            'flags': parsecodec(obj['flags']) | (PT_IMG if "img" in obj['flags'] else 0x00) | (PT_REG if "reg" in obj['flags'] else 0x00),
             'sha256': sha256(data).hexdigest(),
             'data': data
         }
 
     def parseargentry(arg):
-        m = match('^([a-zA-Z0-9_/.]+)=([a-z,]+):(.*)$', arg)
+        m = match('^([a-zA-Z0-9_/.]+)=([a-z0-9,]+):(.*)$', arg)
         if not m: raise ValueError("Bad parse key=flag1,flag2:value: {}".format(arg))
         return parsejsonentry({'name': m.group(1), 'flags': m.group(2).split(','), 'value': m.group(3)})
 
@@ -193,7 +393,7 @@ def main():
 
     # Generate and output packfile
     print("== Writing PACK file {} ==".format(output.name))
-    output.write(mkpack(meta, index, strip))
+    output.write(mkpack(meta, index, strip, args.blocksize))
     output.close()
 
 if __name__ == '__main__':
@@ -0,0 +1,345 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/lock.h>
+#include <unistd.h>
+#ifdef CONFIG_IDF_TARGET_LINUX
+#include <sys/mman.h>
+#endif
+
+#include <esp_err.h>
+#include <esp_log.h>
+
+#include "packfs-priv.h"
+
+
+typedef struct pfs_backing_t {
+	struct pfs_backing_t * next;
+	char path[PACKFS_MAX_FULLPATH];
+	const packfs_backend_t * backend;
+	void * ud;
+} pfs_backing_t;
+
+static _lock_t backinglock;
+static pfs_backing_t * backings = NULL;
+
+// Stdio backend, used for every path that isn't registered. The linux target also mmaps the file
+
+typedef struct {
+	_lock_t lock;
+	FILE * fp;
+	atomic_bool nopread;		/* Filesystem has no pread, every read goes through lock */
+	uint32_t position;
+#ifdef CONFIG_IDF_TARGET_LINUX
+	const uint8_t * mapped;
+	size_t mappedlength;
+#endif
+} pfs_stdio_t;
+
+static void * pfs_stdio_open(const char * path, void * ud) {
+	pfs_stdio_t * stdio = calloc(1, sizeof(pfs_stdio_t));
+	if (stdio == NULL) {
+		return NULL;
+	}
+
+	if ((stdio->fp = pfs_openbacking(path, NULL)) == NULL) {
+		free(stdio);
+		return NULL;
+	}
+
+#ifdef CONFIG_IDF_TARGET_LINUX
+	struct stat st;
+	if (fstat(fileno(stdio->fp), &st) == 0 && st.st_size > 0) {
+		void * mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(stdio->fp), 0);
+		if (mapped != MAP_FAILED) {
+			stdio->mapped = mapped;
+			stdio->mappedlength = st.st_size;
+		}
+	}
+#endif
+
+	return stdio;
+}
+
+static void pfs_stdio_close(void * handle) {
+	pfs_stdio_t * stdio = handle;
+#ifdef CONFIG_IDF_TARGET_LINUX
+	if (stdio->mapped != NULL) munmap((void *)stdio->mapped, stdio->mappedlength);
+#endif
+	fclose(stdio->fp);
+	_lock_close(&stdio->lock);
+	free(stdio);
+}
+
+static bool pfs_stdio_stat(const char * path, void * ud, uint32_t * out_length, time_t * out_mtime) {
+	struct stat st;
+	memset(&st, 0, sizeof(struct stat));
+	if (stat(path, &st) != 0) {
+		return false;
+	}
+
+	*out_length = st.st_size;
+	*out_mtime = st.st_mtime;
+	return true;
+}
+
+static bool pfs_stdio_pread(pfs_stdio_t * stdio, uint32_t offset, void * buffer, size_t length) {
+	uint8_t * data = buffer;
+	while (length > 0) {
+		ssize_t bytes = pread(fileno(stdio->fp), data, length, offset);
+		if (bytes <= 0) {
+			if (bytes < 0 && (errno == ENOSYS || errno == ENOTSUP)) {
+				stdio->nopread = true;
+			}
+			return false;
+		}
+
+		data += bytes;
+		offset += bytes;
+		length -= bytes;
+	}
+
+	return true;
+}
+
+static bool pfs_stdio_readat(void * handle, uint32_t offset, void * buffer, size_t length) {
+	pfs_stdio_t * stdio = handle;
+	bool success = false;
+
+	// Positioned reads leave the file offset alone, so fds and workers don't wait on each other
+	if (!stdio->nopread) {
+		success = pfs_stdio_pread(stdio, offset, buffer, length);
+		if (success || !stdio->nopread) {
+			return success;
+		}
+	}
+
+	// No pread on this filesystem, share the stream and skip the seek when reads are sequential
+	_lock_acquire(&stdio->lock);
+	{
+		if (stdio->position == offset || fseek(stdio->fp, offset, SEEK_SET) == 0) {
+			success = fread(buffer, length, 1, stdio->fp) == 1;
+			stdio->position = success? offset + length : UINT32_MAX;
+		}
+	}
+	_lock_release(&stdio->lock);
+	return success;
+}
+
+#ifdef CONFIG_IDF_TARGET_LINUX
+static const void * pfs_stdio_map(void * handle, uint32_t offset, size_t length) {
+	pfs_stdio_t * stdio = handle;
+	if (stdio->mapped == NULL || offset > stdio->mappedlength || length > (stdio->mappedlength - offset)) {
+		return NULL;
+	}
+
+	return &stdio->mapped[offset];
+}
+#endif
+
+static const packfs_backend_t pfs_stdio_backend = {
+	.open = pfs_stdio_open,
+	.close = pfs_stdio_close,
+	.stat = pfs_stdio_stat,
+	.readat = pfs_stdio_readat,
+#ifdef CONFIG_IDF_TARGET_LINUX
+	.map = pfs_stdio_map
+#else
+	.map = NULL
+#endif
+};
+
+// Memory backend, handle is the registered buffer
+
+typedef struct {
+	const uint8_t * data;
+	size_t length;
+} pfs_memory_t;
+
+static void * pfs_memory_open(const char * path, void * ud) {
+	return ud;
+}
+
+static void pfs_memory_close(void * handle) {
+	// Buffer is owned by the registration
+}
+
+static bool pfs_memory_stat(const char * path, void * ud, uint32_t * out_length, time_t * out_mtime) {
+	*out_length = ((pfs_memory_t *)ud)->length;
+	*out_mtime = 0;
+	return true;
+}
+
+static const void * pfs_memory_map(void * handle, uint32_t offset, size_t length) {
+	pfs_memory_t * memory = handle;
+	if (offset > memory->length || length > (memory->length - offset)) {
+		return NULL;
+	}
+
+	return &memory->data[offset];
+}
+
+static bool pfs_memory_readat(void * handle, uint32_t offset, void * buffer, size_t length) {
+	const void * data = pfs_memory_map(handle, offset, length);
+	if (data == NULL) {
+		return false;
+	}
+
+	memcpy(buffer, data, length);
+	return true;
+}
+
+static const packfs_backend_t pfs_memory_backend = {
+	.open = pfs_memory_open,
+	.close = pfs_memory_close,
+	.stat = pfs_memory_stat,
+	.readat = pfs_memory_readat,
+	.map = pfs_memory_map
+};
+
+#ifdef CONFIG_PACKFS_PARTITION_SUPPORT
+// Raw partition backend, mapped into the address space when possible
+
+typedef struct {
+	const esp_partition_t * partition;
+	const uint8_t * mapped;
+	spi_flash_mmap_handle_t mmap;
+} pfs_partition_t;
+
+static void * pfs_partition_open(const char * path, void * ud) {
+	return ud;
+}
+
+static void pfs_partition_close(void * handle) {
+	// Partition is owned by the registration
+}
+
+static bool pfs_partition_stat(const char * path, void * ud, uint32_t * out_length, time_t * out_mtime) {
+	*out_length = ((pfs_partition_t *)ud)->partition->size;
+	*out_mtime = 0;
+	return true;
+}
+
+static const void * pfs_partition_map(void * handle, uint32_t offset, size_t length) {
+	pfs_partition_t * part = handle;
+	if (part->mapped == NULL || offset > part->partition->size || length > (part->partition->size - offset)) {
+		return NULL;
+	}
+
+	return &part->mapped[offset];
+}
+
+static bool pfs_partition_readat(void * handle, uint32_t offset, void * buffer, size_t length) {
+	pfs_partition_t * part = handle;
+	const void * data = pfs_partition_map(handle, offset, length);
+	if (data != NULL) {
+		memcpy(buffer, data, length);
+		return true;
+	}
+
+	return esp_partition_read(part->partition, offset, buffer, length) == ESP_OK;
+}
+
+static const packfs_backend_t pfs_partition_backend = {
+	.open = pfs_partition_open,
+	.close = pfs_partition_close,
+	.stat = pfs_partition_stat,
+	.readat = pfs_partition_readat,
+	.map = pfs_partition_map
+};
+#endif
+
+const packfs_backend_t * pfs_backendfind(const char * path, void ** out_ud) {
+	const packfs_backend_t * backend = &pfs_stdio_backend;
+	*out_ud = NULL;
+
+	_lock_acquire(&backinglock);
+	{
+		for (pfs_backing_t * b = backings; b != NULL; b = b->next) {
+			if (strcmp(b->path, path) == 0) {
+				backend = b->backend;
+				*out_ud = b->ud;
+				break;
+			}
+		}
+	}
+	_lock_release(&backinglock);
+	return backend;
+}
+
+esp_err_t packfs_backend_register(const char * path, const packfs_backend_t * backend, void * ud) {
+	// Sanity check args
+	if unlikely(path == NULL || backend == NULL || backend->open == NULL || backend->close == NULL || backend->stat == NULL || backend->readat == NULL) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	pfs_backing_t * backing = calloc(1, sizeof(pfs_backing_t));
+	if (backing == NULL) {
+		return ESP_ERR_NO_MEM;
+	}
+
+	if (strlcpy(backing->path, path, sizeof(backing->path)) >= sizeof(backing->path)) {
+		free(backing);
+		return ESP_ERR_INVALID_ARG;
+	}
+	backing->backend = backend;
+	backing->ud = ud;
+
+	_lock_acquire(&backinglock);
+	{
+		backing->next = backings;
+		backings = backing;
+	}
+	_lock_release(&backinglock);
+	return ESP_OK;
+}
+
+esp_err_t packfs_backend_register_memory(const char * path, const void * data, size_t length) {
+	// Sanity check args
+	if unlikely(data == NULL) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	pfs_memory_t * memory = calloc(1, sizeof(pfs_memory_t));
+	if (memory == NULL) {
+		return ESP_ERR_NO_MEM;
+	}
+	memory->data = data;
+	memory->length = length;
+
+	esp_err_t err = packfs_backend_register(path, &pfs_memory_backend, memory);
+	if (err != ESP_OK) {
+		free(memory);
+	}
+	return err;
+}
+
+#ifdef CONFIG_PACKFS_PARTITION_SUPPORT
+esp_err_t packfs_backend_register_partition(const char * path, const esp_partition_t * partition) {
+	// Sanity check args
+	if unlikely(partition == NULL) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	pfs_partition_t * part = calloc(1, sizeof(pfs_partition_t));
+	if (part == NULL) {
+		return ESP_ERR_NO_MEM;
+	}
+	part->partition = partition;
+
+	// Reads go through esp_partition_read if the partition can't be mapped
+	const void * mapped = NULL;
+	if (esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &mapped, &part->mmap) == ESP_OK) {
+		part->mapped = mapped;
+	} else {
+		ESP_LOGW(PACKFS_TAG, "Failed to map partition, using reads: label=%s", partition->label);
+	}
+
+	esp_err_t err = packfs_backend_register(path, &pfs_partition_backend, part);
+	if (err != ESP_OK) {
+		if (part->mapped != NULL) spi_flash_munmap(part->mmap);
+		free(part);
+	}
+	return err;
+}
+#endif
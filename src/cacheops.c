@@ -0,0 +1,644 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/lock.h>
+
+#include <esp_err.h>
+#include <esp_log.h>
+
+#include "packfs-priv.h"
+
+
+static _lock_t cachelock;
+static pfs_cache_t * caches = NULL;
+static uint32_t nextid = 1;
+
+bool pfs_indexiter_init(pfs_indexiter_t * it, const packfs_header_t * header, const uint8_t * index) {
+	memset(it, 0, sizeof(pfs_indexiter_t));
+	it->compact = (header->flags & PH_COMPACTINDEX) != 0;
+	it->index = index;
+
+	if (!it->compact) {
+		it->count = header->indexsize / sizeof(packfs_entry_t);
+		return true;
+	}
+
+	// Sanity check the record table fits
+	if (header->indexsize < sizeof(packfs_cindex_t)) {
+		return false;
+	}
+
+	it->count = ((const packfs_cindex_t *)index)->numentries;
+	size_t recordsize = sizeof(packfs_cindex_t) + (size_t)it->count * sizeof(packfs_centry_t);
+	if (recordsize > header->indexsize) {
+		return false;
+	}
+
+	it->strtab = &index[recordsize];
+	it->strtabsize = header->indexsize - recordsize;
+	return true;
+}
+
+bool pfs_indexiter_next(pfs_indexiter_t * it, packfs_entry_t * out_entry) {
+	if (it->on >= it->count) {
+		return false;
+	}
+
+	if (!it->compact) {
+		memcpy(out_entry, &((const packfs_entry_t *)it->index)[it->on++], sizeof(packfs_entry_t));
+		out_entry->path[PACKFS_MAX_INDEXPATH - 1] = '\0';
+		return true;
+	}
+
+	packfs_centry_t c;
+	memcpy(&c, &it->index[sizeof(packfs_cindex_t) + it->on * sizeof(packfs_centry_t)], sizeof(packfs_centry_t));
+
+	// Front-coded name is a shared prefix length with the previous path, then the suffix
+	if (c.name > it->strtabsize || (it->strtabsize - c.name) < 2) {
+		return false;
+	}
+	uint8_t shared = it->strtab[c.name];
+	uint8_t suffix = it->strtab[c.name + 1];
+	if (shared > it->pathlen || ((size_t)shared + suffix) > (PACKFS_MAX_INDEXPATH - 1) || (it->strtabsize - c.name - 2) < suffix) {
+		return false;
+	}
+	memcpy(&it->path[shared], &it->strtab[c.name + 2], suffix);
+	it->pathlen = shared + suffix;
+	it->path[it->pathlen] = '\0';
+
+	// Expand the record
+	out_entry->flags = c.flags;
+	out_entry->offset = c.offset;
+	out_entry->length = c.length;
+	memcpy(out_entry->entryhash, c.entryhash, sizeof(packfs_sha256_t));
+	strlcpy(out_entry->path, it->path, sizeof(out_entry->path));
+
+	it->on += 1;
+	return true;
+}
+
+static void pfs_cachefree(pfs_cache_t * cache) {
+	if (cache == NULL) return;
+
+	free(cache->slots);
+	free(cache->dirs);
+	free(cache->bloom);
+	free(cache->sizes);
+	if (cache->handle != NULL) cache->backend->close(cache->handle);
+	_lock_close(&cache->handlelock);
+	free(cache);
+}
+
+static bool pfs_cachesectionread(pfs_cache_t * cache, uint32_t * offset, void * buffer, size_t length) {
+	if (!cache->backend->readat(cache->handle, *offset, buffer, length)) {
+		return false;
+	}
+
+	*offset += length;
+	return true;
+}
+
+static bool pfs_cachesection(pfs_cache_t * cache, uint32_t * offset, uint8_t type) {
+	packfs_section_t section;
+	if (!pfs_cachesectionread(cache, offset, &section, sizeof(packfs_section_t)) || section.type != type) {
+		return false;
+	}
+
+	switch (type) {
+		case PH_HASHTABLE: {
+			// Slot count must be a power of two for masking
+			uint32_t numslots = section.size / sizeof(packfs_hashslot_t);
+			if (numslots == 0 || (numslots & (numslots - 1)) != 0 || (section.size % sizeof(packfs_hashslot_t)) != 0) {
+				return false;
+			}
+
+			if ((cache->slots = malloc(section.size)) == NULL || !pfs_cachesectionread(cache, offset, cache->slots, section.size)) {
+				return false;
+			}
+			cache->numslots = numslots;
+			return true;
+		}
+		case PH_DIRTABLE: {
+			uint32_t numdirs = section.size / sizeof(packfs_dirrange_t);
+			if ((section.size % sizeof(packfs_dirrange_t)) != 0 || !(cache->header.flags & PH_SORTEDINDEX)) {
+				return false;
+			}
+
+			if ((cache->dirs = malloc(section.size)) == NULL || !pfs_cachesectionread(cache, offset, cache->dirs, section.size)) {
+				return false;
+			}
+
+			// Make sure every range lands inside the index
+			for (uint32_t i = 0; i < numdirs; i++) {
+				packfs_dirrange_t * d = &cache->dirs[i];
+				if (d->count == 0 || d->first >= cache->numentries || d->count > (cache->numentries - d->first) || d->pathlen > strlen(pfs_cachepath(cache, d->first))) {
+					return false;
+				}
+			}
+			cache->numdirs = numdirs;
+			return true;
+		}
+		case PH_BLOOMFILTER: {
+			packfs_bloom_t bloom;
+			if (section.size < sizeof(packfs_bloom_t) || !pfs_cachesectionread(cache, offset, &bloom, sizeof(packfs_bloom_t))) {
+				return false;
+			}
+
+			// Bit count must be a power of two for masking
+			if (bloom.numprobes == 0 || bloom.numbits < 8 || (bloom.numbits & (bloom.numbits - 1)) != 0 || (section.size - sizeof(packfs_bloom_t)) != (bloom.numbits / 8)) {
+				return false;
+			}
+
+			if ((cache->bloom = malloc(bloom.numbits / 8)) == NULL || !pfs_cachesectionread(cache, offset, cache->bloom, bloom.numbits / 8)) {
+				return false;
+			}
+			cache->bloomprobes = bloom.numprobes;
+			cache->bloommask = bloom.numbits - 1;
+			return true;
+		}
+		case PH_SIZETABLE: {
+			if (section.size != (cache->numentries * sizeof(packfs_sizeinfo_t))) {
+				return false;
+			}
+
+			if (section.size > 0 && ((cache->sizes = malloc(section.size)) == NULL || !pfs_cachesectionread(cache, offset, cache->sizes, section.size))) {
+				return false;
+			}
+			return true;
+		}
+		default: {
+			// Unknown section, skip it
+			*offset += section.size;
+			return true;
+		}
+	}
+}
+
+static pfs_cache_t * pfs_cacheload(const char * backingpath, const packfs_backend_t * backend, void * ud, void * handle, const packfs_header_t * rawheader, uint32_t length, time_t mtime) {
+	labels(loaderr); // @suppress("Type cannot be resolved")
+
+	pfs_cache_t * cache = NULL;
+	packfs_header_t header;
+	const uint8_t * index = NULL;
+	uint8_t * raw = NULL;
+
+	// Check header, the handle is ours from here on
+	memcpy(&header, rawheader, sizeof(packfs_header_t));
+	if (!pfs_checkheader(&header)) {
+		errnogoto(EFTYPE, loaderr);
+	}
+
+	// Check version
+	if (header.version < PACKFS_VERSION_MIN || header.version > PACKFS_VERSION) {
+		errnogoto(EPERM, loaderr);
+	}
+
+	// Skip the meta section and map or read in the raw index in one go
+	uint32_t offset = sizeof(packfs_header_t) + header.metasize;
+	if (header.indexsize > 0 && (backend->map == NULL || (index = backend->map(handle, offset, header.indexsize)) == NULL)) {
+		if ((raw = malloc(header.indexsize)) == NULL) {
+			errnogoto(ENOMEM, loaderr);
+		}
+		if (!backend->readat(handle, offset, raw, header.indexsize)) {
+			errnogoto(EIO, loaderr);
+		}
+		index = raw;
+	}
+	offset += header.indexsize;
+
+	// Size up the path pool
+	pfs_indexiter_t it;
+	packfs_entry_t entry;
+	size_t pathsize = 0;
+	if (!pfs_indexiter_init(&it, &header, index)) {
+		errnogoto(EFTYPE, loaderr);
+	}
+	while (it.on < it.count) {
+		if (!pfs_indexiter_next(&it, &entry)) {
+			errnogoto(EFTYPE, loaderr);
+		}
+		pathsize += strlen(entry.path) + 1;
+	}
+
+	// Allocate cache with compact records and a path pool
+	if ((cache = calloc(1, sizeof(pfs_cache_t) + it.count * sizeof(packfs_centry_t) + pathsize)) == NULL) {
+		errnogoto(ENOMEM, loaderr);
+	}
+	cache->numentries = it.count;
+	cache->entries = (packfs_centry_t *)cache->data;
+	cache->paths = (char *)&cache->entries[it.count];
+
+	// Fill in the records
+	pathsize = 0;
+	pfs_indexiter_init(&it, &header, index);
+	for (unsigned int i = 0; i < cache->numentries; i++) {
+		pfs_indexiter_next(&it, &entry);
+
+		packfs_centry_t * c = &cache->entries[i];
+		c->flags = entry.flags;
+		c->offset = entry.offset;
+		c->length = entry.length;
+		memcpy(c->entryhash, entry.entryhash, sizeof(packfs_sha256_t));
+		c->name = pathsize;
+		pathsize += strlcpy(&cache->paths[pathsize], entry.path, PACKFS_MAX_INDEXPATH) + 1;
+	}
+
+	free(raw);
+	raw = NULL;
+
+	strlcpy(cache->path, backingpath, sizeof(cache->path));
+	cache->length = length;
+	cache->mtime = mtime;
+	memcpy(&cache->header, &header, sizeof(packfs_header_t));
+
+	// Keep the handle around as the shared backing file
+	cache->backend = backend;
+	cache->backendud = ud;
+	cache->handle = handle;
+	handle = NULL;
+
+	// Read in optional sections that follow the index
+	for (unsigned int flag = 0x01; flag <= 0xff; flag <<= 1) {
+		if ((header.flags & PACKFS_SECTIONS & flag) && !pfs_cachesection(cache, &offset, flag)) {
+			errnogoto(EFTYPE, loaderr);
+		}
+	}
+
+	return cache;
+
+loaderr:
+	if (handle != NULL) backend->close(handle);
+	free(raw);
+	pfs_cachefree(cache);
+	return NULL;
+}
+
+static void pfs_cacheunlink(pfs_cache_t ** link) {
+	pfs_cache_t * cache = *link;
+
+	// Remove from list, free now if nobody is holding it
+	*link = cache->next;
+	cache->next = NULL;
+	cache->stale = true;
+	if (cache->refs == 0) {
+		pfs_cachefree(cache);
+	}
+}
+
+static void pfs_cachetrim(void) {
+	// List is kept most recently used first, drop idle caches past the limit
+	unsigned int idle = 0;
+	for (pfs_cache_t ** link = &caches; *link != NULL;) {
+		if ((*link)->refs == 0 && ++idle > CONFIG_PACKFS_INDEXCACHE_IDLE) {
+			pfs_cacheunlink(link);
+		} else {
+			link = &(*link)->next;
+		}
+	}
+}
+
+static bool pfs_cachematches(pfs_cache_t * cache, const packfs_backend_t * backend, uint32_t length, time_t mtime) {
+	return cache->backend == backend && cache->length == length && cache->mtime == mtime;
+}
+
+static bool pfs_cachecurrent(pfs_cache_t * cache) {
+	// Backends without an mtime (SPIFFS) report 0, the header hashes catch a pack rewritten at
+	// the same size. Read it through the shared handle, reopened only if the cache let go of it
+	if (cache->mtime != 0) {
+		return true;
+	}
+
+	packfs_header_t header;
+	return pfs_cacheopen(cache) && pfs_cacheread(cache, 0, &header, sizeof(packfs_header_t)) && memcmp(&cache->header, &header, sizeof(packfs_header_t)) == 0;
+}
+
+static void pfs_cachedrop(pfs_cache_t * cache) {
+	// Unlink a cache found out of date, it's freed once its last user lets go
+	_lock_acquire(&cachelock);
+	{
+		for (pfs_cache_t ** link = &caches; *link != NULL; link = &(*link)->next) {
+			if (*link == cache) {
+				pfs_cacheunlink(link);
+				break;
+			}
+		}
+	}
+	_lock_release(&cachelock);
+}
+
+pfs_cache_t * pfs_cacheget(const char * backingpath) {
+	// Stat the backing file, length and mtime validate the cached copy
+	void * ud = NULL;
+	const packfs_backend_t * backend = pfs_backendfind(backingpath, &ud);
+	uint32_t length = 0;
+	time_t mtime = 0;
+	bool exists = backend->stat(backingpath, ud, &length, &mtime);
+
+	pfs_cache_t * cache = NULL;
+	_lock_acquire(&cachelock);
+	{
+		for (pfs_cache_t ** link = &caches; *link != NULL; link = &(*link)->next) {
+			pfs_cache_t * c = *link;
+			if (strcmp(c->path, backingpath) != 0) {
+				continue;
+			}
+
+			if (exists && pfs_cachematches(c, backend, length, mtime)) {
+				// Cache hit, move to the front
+				*link = c->next;
+				c->next = caches;
+				caches = c;
+				c->refs += 1;
+				cache = c;
+				break;
+			}
+
+			// Backing file changed or disappeared
+			pfs_cacheunlink(link);
+			break;
+		}
+	}
+	_lock_release(&cachelock);
+
+	if (cache != NULL) {
+		if (pfs_cachecurrent(cache)) {
+			return cache;
+		}
+
+		// Rewritten in place, parse it again
+		pfs_cachedrop(cache);
+		pfs_cacheput(cache);
+	}
+
+	if (!exists) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	// Open and parse the pack outside of the lock
+	packfs_header_t header;
+	void * handle = backend->open(backingpath, ud);
+	if (handle == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+	if (!backend->readat(handle, 0, &header, sizeof(packfs_header_t))) {
+		backend->close(handle);
+		errno = EFTYPE;
+		return NULL;
+	}
+
+	if ((cache = pfs_cacheload(backingpath, backend, ud, handle, &header, length, mtime)) == NULL) {
+		return NULL;
+	}
+
+	_lock_acquire(&cachelock);
+	{
+		// Make sure nobody beat us to it
+		for (pfs_cache_t * c = caches; c != NULL; c = c->next) {
+			if (strcmp(c->path, backingpath) == 0 && pfs_cachematches(c, cache->backend, cache->length, cache->mtime) && memcmp(&c->header, &cache->header, sizeof(packfs_header_t)) == 0) {
+				c->refs += 1;
+				_lock_release(&cachelock);
+				pfs_cachefree(cache);
+				return c;
+			}
+		}
+
+		cache->refs = 1;
+		cache->id = nextid++;
+		cache->next = caches;
+		caches = cache;
+		pfs_cachetrim();
+	}
+	_lock_release(&cachelock);
+
+	return cache;
+}
+
+void pfs_cacheput(pfs_cache_t * cache) {
+	if unlikely(cache == NULL) return;
+
+	_lock_acquire(&cachelock);
+	{
+		cache->refs -= 1;
+		if (cache->refs == 0 && cache->stale) {
+			pfs_cachefree(cache);
+
+		} else if (cache->refs == 0) {
+			// Nobody is reading, don't hold the backing file open
+			if (cache->handle != NULL) {
+				cache->backend->close(cache->handle);
+				cache->handle = NULL;
+			}
+
+			// Keep only the most recently used idle caches around
+			pfs_cachetrim();
+		}
+	}
+	_lock_release(&cachelock);
+}
+
+bool pfs_cacheopen(pfs_cache_t * cache) {
+	bool success = true;
+
+	_lock_acquire(&cache->handlelock);
+	{
+		if (cache->handle == NULL) {
+			success = (cache->handle = cache->backend->open(cache->path, cache->backendud)) != NULL;
+		}
+	}
+	_lock_release(&cache->handlelock);
+	return success;
+}
+
+bool pfs_cacheread(pfs_cache_t * cache, uint32_t offset, void * buffer, size_t length) {
+	// Positioned read, every fd keeps its own offset and shares the one handle
+	return cache->handle != NULL && cache->backend->readat(cache->handle, offset, buffer, length);
+}
+
+const void * pfs_cachemap(pfs_cache_t * cache, uint32_t offset, size_t length) {
+	return (cache->handle != NULL && cache->backend->map != NULL)? cache->backend->map(cache->handle, offset, length) : NULL;
+}
+
+bool pfs_readindex(pfs_cache_t * cache, unsigned int index, packfs_entry_t * entry) {
+	if unlikely(index >= cache->numentries) {
+		return false;
+	}
+
+	// Expand compact record
+	packfs_centry_t * c = &cache->entries[index];
+	entry->flags = c->flags;
+	entry->offset = c->offset;
+	entry->length = c->length;
+	memcpy(entry->entryhash, c->entryhash, sizeof(packfs_sha256_t));
+	strlcpy(entry->path, pfs_cachepath(cache, index), sizeof(entry->path));
+	return true;
+}
+
+uint32_t pfs_pathhash(const char * path) {
+	// 32-bit FNV-1a
+	uint32_t hash = 0x811c9dc5;
+	while (*path != '\0') {
+		hash ^= (uint8_t)*path++;
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+static bool pfs_bloomtest(pfs_cache_t * cache, uint32_t hash) {
+	uint32_t step = ((hash << 16) | (hash >> 16)) | 1;
+	for (uint8_t i = 0; i < cache->bloomprobes; i++, hash += step) {
+		uint32_t bit = hash & cache->bloommask;
+		if ((cache->bloom[bit / 8] & (1 << (bit % 8))) == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool pfs_findindex(pfs_cache_t * cache, const char * path, uint32_t * out_index) {
+	uint32_t hash = (cache->bloom != NULL || cache->slots != NULL)? pfs_pathhash(path) : 0;
+
+	// Bloom filter rejects most misses without touching the index
+	if (cache->bloom != NULL && !pfs_bloomtest(cache, hash)) {
+		return false;
+	}
+
+	if (cache->slots != NULL) {
+		// Probe hash table, an empty slot means the path isn't in the pack
+		uint32_t mask = cache->numslots - 1;
+		for (uint32_t i = 0, slot = hash & mask; i < cache->numslots; i++, slot = (slot + 1) & mask) {
+			packfs_hashslot_t * s = &cache->slots[slot];
+			if (s->index == PACKFS_HASHSLOT_EMPTY) {
+				return false;
+			}
+
+			if (s->hash == hash && s->index < cache->numentries && strcmp(path, pfs_cachepath(cache, s->index)) == 0) {
+				*out_index = s->index;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	if (cache->header.flags & PH_SORTEDINDEX) {
+		// Binary search sorted index
+		unsigned int lo = 0, hi = cache->numentries;
+		while (lo < hi) {
+			unsigned int mid = lo + (hi - lo) / 2;
+			int cmp = strcmp(path, pfs_cachepath(cache, mid));
+			if (cmp == 0) {
+				*out_index = mid;
+				return true;
+			} else if (cmp < 0) {
+				hi = mid;
+			} else {
+				lo = mid + 1;
+			}
+		}
+
+		return false;
+	}
+
+	// Linear scan unsorted index
+	for (unsigned int i = 0; i < cache->numentries; i++) {
+		if (strcmp(path, pfs_cachepath(cache, i)) == 0) {
+			*out_index = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool pfs_findentry(pfs_cache_t * cache, const char * path, packfs_entry_t * out_entry) {
+	uint32_t index = 0;
+	return pfs_findindex(cache, path, &index) && pfs_readindex(cache, index, out_entry);
+}
+
+static int pfs_prefixcmp(const char * a, size_t alen, const char * b, size_t blen) {
+	int cmp = memcmp(a, b, min(alen, blen));
+	return cmp != 0? cmp : (alen > blen) - (alen < blen);
+}
+
+bool pfs_dirprefix(const char * subpath, char * prefix, size_t prefixsize, size_t * out_prefixlen) {
+	// Directory prefixes end with a '/'. A leading '/' is kept, imagefs packs store rooted paths
+	size_t prefixlen = 0;
+	prefix[0] = '\0';
+	if (subpath != NULL && subpath[0] != '\0') {
+		if ((prefixlen = strlcpy(prefix, subpath, prefixsize)) >= (prefixsize - 1)) {
+			return false;
+		}
+
+		if (prefix[prefixlen - 1] != '/') {
+			prefix[prefixlen++] = '/';
+			prefix[prefixlen] = '\0';
+		}
+	}
+
+	*out_prefixlen = prefixlen;
+	return true;
+}
+
+bool pfs_finddir(pfs_cache_t * cache, const char * prefix, size_t prefixlen, uint32_t * out_first, uint32_t * out_end) {
+	if (pfs_dirroot(prefix, prefixlen)) {
+		// Root directory covers the entire index
+		*out_first = 0;
+		*out_end = cache->numentries;
+		return true;
+	}
+
+	if (cache->dirs != NULL) {
+		// Binary search directory table
+		uint32_t lo = 0, hi = cache->numdirs;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			packfs_dirrange_t * d = &cache->dirs[mid];
+			int cmp = pfs_prefixcmp(prefix, prefixlen, pfs_cachepath(cache, d->first), d->pathlen);
+			if (cmp == 0) {
+				*out_first = d->first;
+				*out_end = d->first + d->count;
+				return true;
+			} else if (cmp < 0) {
+				hi = mid;
+			} else {
+				lo = mid + 1;
+			}
+		}
+
+		return false;
+	}
+
+	if (cache->header.flags & PH_SORTEDINDEX) {
+		// Binary search for the first and last entry with the prefix
+		uint32_t lo = 0, hi = cache->numentries;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (strncmp(pfs_cachepath(cache, mid), prefix, prefixlen) < 0) lo = mid + 1;
+			else hi = mid;
+		}
+		*out_first = lo;
+
+		hi = cache->numentries;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (strncmp(pfs_cachepath(cache, mid), prefix, prefixlen) <= 0) lo = mid + 1;
+			else hi = mid;
+		}
+		*out_end = lo;
+
+		return *out_end > *out_first;
+	}
+
+	// Unsorted index, directory spans everything and gets filtered while reading
+	for (uint32_t i = 0; i < cache->numentries; i++) {
+		if (strncmp(pfs_cachepath(cache, i), prefix, prefixlen) == 0) {
+			*out_first = i;
+			*out_end = cache->numentries;
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,182 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "minilzo.h"
+#include "packfs-priv.h"
+
+#ifndef CONFIG_PACKFS_LZO_SUPPORT
+#error "This file should NOT be included if CONFIG_PACKFS_LZO_SUPPORT is not set."
+#else
+
+// Every codec decodes one self-contained block into the block buffer, so none need a window
+// or scratch memory beyond the compressed and uncompressed block buffers. Decoders only write
+// behind what they have read, so input may sit at the tail of the output buffer (in place)
+
+static bool pfs_codec_lzo_init(void) {
+	return lzo_init() == LZO_E_OK;
+}
+
+static bool pfs_codec_lzo_decode(const uint8_t * in, size_t inlen, uint8_t * out, size_t * outlen) {
+	lzo_uint len = *outlen;
+	if (lzo1x_decompress_safe(in, inlen, out, &len, NULL) != LZO_E_OK) {
+		return false;
+	}
+
+	*outlen = len;
+	return true;
+}
+
+#ifdef CONFIG_PACKFS_LZ4_SUPPORT
+static bool pfs_codec_lz4_length(const uint8_t ** ip, const uint8_t * iend, size_t * length) {
+	// Lengths of 15 continue in following bytes until one isn't 255
+	uint8_t b = 255;
+	while (b == 255) {
+		if (*ip == iend) {
+			return false;
+		}
+		b = *(*ip)++;
+		*length += b;
+	}
+
+	return true;
+}
+
+static bool pfs_codec_lz4_decode(const uint8_t * in, size_t inlen, uint8_t * out, size_t * outlen) {
+	const uint8_t * ip = in, * iend = in + inlen;
+	uint8_t * op = out, * oend = out + *outlen;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+
+		// Copy literals
+		size_t length = token >> 4;
+		if (length == 15 && !pfs_codec_lz4_length(&ip, iend, &length)) {
+			return false;
+		}
+		if (length > (size_t)(iend - ip) || length > (size_t)(oend - op)) {
+			return false;
+		}
+		memmove(op, ip, length);
+		ip += length;
+		op += length;
+
+		// Last sequence has literals only
+		if (ip == iend) {
+			break;
+		}
+
+		// Copy match, byte at a time since it may overlap itself
+		if ((iend - ip) < 2) {
+			return false;
+		}
+		size_t distance = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (distance == 0 || distance > (size_t)(op - out)) {
+			return false;
+		}
+
+		length = token & 0x0F;
+		if (length == 15 && !pfs_codec_lz4_length(&ip, iend, &length)) {
+			return false;
+		}
+		length += 4;
+		if (length > (size_t)(oend - op)) {
+			return false;
+		}
+		for (const uint8_t * match = op - distance; length > 0; length--) {
+			*op++ = *match++;
+		}
+	}
+
+	*outlen = op - out;
+	return true;
+}
+#endif
+
+#ifdef CONFIG_PACKFS_HEATSHRINK_SUPPORT
+typedef struct {
+	const uint8_t * in;
+	size_t inlen;
+	size_t bit;
+} pfs_bitreader_t;
+
+static bool pfs_codec_heatshrink_bits(pfs_bitreader_t * br, unsigned int count, uint16_t * value) {
+	if (count > (br->inlen * 8 - br->bit)) {
+		return false;
+	}
+
+	// Bits are packed msb first
+	*value = 0;
+	for (; count > 0; count--, br->bit++) {
+		*value = (*value << 1) | ((br->in[br->bit / 8] >> (7 - (br->bit % 8))) & 0x01);
+	}
+
+	return true;
+}
+
+static bool pfs_codec_heatshrink_decode(const uint8_t * in, size_t inlen, uint8_t * out, size_t * outlen) {
+	pfs_bitreader_t br = {.in = in, .inlen = inlen, .bit = 0};
+	size_t length = 0;
+
+	// Stream ends when the trailing pad bits can't hold another literal or backref
+	uint16_t tag, value, count;
+	while (length < *outlen && pfs_codec_heatshrink_bits(&br, 1, &tag)) {
+		if (tag) {
+			if (!pfs_codec_heatshrink_bits(&br, 8, &value)) {
+				break;
+			}
+			out[length++] = value;
+			continue;
+		}
+
+		if (!pfs_codec_heatshrink_bits(&br, PACKFS_HEATSHRINK_WINDOW, &value) || !pfs_codec_heatshrink_bits(&br, PACKFS_HEATSHRINK_LOOKAHEAD, &count)) {
+			break;
+		}
+
+		// Window starts out zero filled, references before the block start read zeros
+		size_t distance = (size_t)value + 1;
+		for (count += 1; count > 0; count--) {
+			if (length == *outlen) {
+				return false;
+			}
+			out[length] = (distance > length)? 0 : out[length - distance];
+			length += 1;
+		}
+	}
+
+	*outlen = length;
+	return true;
+}
+#endif
+
+static const pfs_codec_t pfs_codecs[] = {
+	{.flag = PF_CODEC_LZO, .name = "lzo", .init = pfs_codec_lzo_init, .decode = pfs_codec_lzo_decode},
+#ifdef CONFIG_PACKFS_LZ4_SUPPORT
+	{.flag = PF_CODEC_LZ4, .name = "lz4", .init = NULL, .decode = pfs_codec_lz4_decode},
+#endif
+#ifdef CONFIG_PACKFS_HEATSHRINK_SUPPORT
+	{.flag = PF_CODEC_HEATSHRINK, .name = "heatshrink", .init = NULL, .decode = pfs_codec_heatshrink_decode},
+#endif
+};
+
+const pfs_codec_t * pfs_codecfind(uint8_t flags) {
+	for (unsigned int i = 0; i < (sizeof(pfs_codecs) / sizeof(pfs_codec_t)); i++) {
+		if (pfs_codecs[i].flag == (flags & PF_CODEC)) {
+			return &pfs_codecs[i];
+		}
+	}
+
+	return NULL;
+}
+
+bool pfs_initcodecs(void) {
+	for (unsigned int i = 0; i < (sizeof(pfs_codecs) / sizeof(pfs_codec_t)); i++) {
+		if (pfs_codecs[i].init != NULL && !pfs_codecs[i].init()) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+#endif
@@ -6,7 +6,11 @@
 
 #include "packfs-priv.h"
 
+extern const char * pprefix_path;
+
 DIR * pfs_opendir(const char * path) {
+	labels(openerr); // @suppress("Type cannot be resolved")
+
 	if unlikely(path == NULL) {
 		errno = EINVAL;
 		return NULL;
@@ -22,47 +26,27 @@ DIR * pfs_opendir(const char * path) {
 		return NULL;
 	}
 
-	// Allocate dir entry
-	pfs_dirent_t * dir = NULL;
-	if ((dir = xfs_opendir(ctx, path, fd)) == NULL) {
-		pfs_close(fd);
-		return NULL;
-	}
-
-	return (DIR *)dir;
-	/*
-	// Determine basepath
-	char * subpath = strchr(path, PACKFS_PATH_SEPERATOR);
-	size_t pathlen = subpath == NULL? strlen(path) : subpath - path;
-
-	// Open spiffs file
-	uint32_t length = 0;
-	if ((ctx->spiffs_fp = pfs_openbacking(path, pathlen, &length)) == NULL) {
-		errnogoto(ENOTDIR, openerr);
-	}
-
-	// Read and check header
-	packfs_header_t header;
-	if (!pfs_readchunk(ctx, &header, sizeof(packfs_header_t)) || !pfs_checkheader(&header)) {
-		errnogoto(EFTYPE, openerr);
-	}
+	// Get directory path within pack file
+	char rootpath[PACKFS_MAX_FULLPATH] = {0};
+	size_t prefixlen = strlcpy(rootpath, pprefix_path, sizeof(rootpath));
+	const char * subpath = pfs_parsepath(path, &rootpath[prefixlen], sizeof(rootpath) - prefixlen);
 
-	// Check version
-	if (header.version != PACKFS_VERSION) {
-		errnogoto(EPERM, openerr);
+	// Check for successful parse
+	if (rootpath[0] == '\0') {
+		errnogoto(ENOENT, openerr);
 	}
 
-	// Skip the meta section
-	if (!pfs_seekfwd(ctx, header.metasize)) {
-		errnogoto(EIO, openerr);
+	// Allocate dir entry
+	pfs_dirent_t * dir = NULL;
+	if ((dir = xfs_opendir(ctx, rootpath, subpath, fd)) == NULL) {
+		goto openerr;
 	}
-	*/
-
-
-
-	//return (DIR *)dir;
 
+	return (DIR *)dir;
 
+openerr:
+	pfs_close(fd);
+	return NULL;
 }
 
 int pfs_closedir(DIR * pdir) {
@@ -122,7 +106,7 @@ long pfs_telldir(DIR * pdir) {
 	pfs_ctx_t * ctx = NULL;
 
 	// Check parameters
-	if unlikely(pdir == NULL || (ctx = pfs_getctx(dir->fd)) == NULL || ctx->offset < dir->index_start) {
+	if unlikely(pdir == NULL || (ctx = pfs_getctx(dir->fd)) == NULL) {
 		errno = EINVAL;
 		return 0;
 	}
@@ -142,20 +126,16 @@ void pfs_seekdir(DIR * pdir, long offset) {
 	}
 
 	// Sanity check offset
-	uint32_t bytesoffset = offset * sizeof(packfs_entry_t);
-	if (bytesoffset > dir->index_length) {
+	if (offset > (dir->end - dir->first)) {
 		errno = EINVAL;
 		return;
 	}
 
 	// Seek to offset
-	if (!pfs_seekabs(ctx, dir->index_start + bytesoffset)) {
-		errno = EIO;
-		return;
-	}
+	dir->position = dir->first + offset;
 }
 
-pfs_dirent_t * xfs_opendir(pfs_ctx_t * ctx, const char * path, int fd) {
+pfs_dirent_t * xfs_opendir(pfs_ctx_t * ctx, const char * backingpath, const char * subpath, int fd) {
 	labels(openerr); // @suppress("Type cannot be resolved")
 
 	// Allocate the dir context
@@ -165,16 +145,28 @@ pfs_dirent_t * xfs_opendir(pfs_ctx_t * ctx, const char * path, int fd) {
 		return NULL;
 	}
 
+	// Build the directory prefix, always ends with a '/' unless root
+	if (!pfs_dirprefix(subpath, dir->prefix, sizeof(dir->prefix), &dir->prefixlen)) {
+		errnogoto(ENAMETOOLONG, openerr);
+	}
+
 	// Open the file
-	packfs_header_t header;
-	if (!xfs_open(ctx, path, NULL, &dir->file_length, &header)) {
+	if (!xfs_open(ctx, backingpath, NULL, &dir->file_length, NULL)) {
 		errnogoto(ENOTDIR, openerr);
 	}
 
+	// Find the range of entries below the directory
+	if (!pfs_finddir(ctx->cache, dir->prefix, dir->prefixlen, &dir->first, &dir->end)) {
+		// Opening a regular file as a directory is ENOTDIR
+		packfs_entry_t entry;
+		dir->prefix[dir->prefixlen - 1] = '\0';
+		errnogoto(pfs_findentry(ctx->cache, dir->prefix, &entry)? ENOTDIR : ENOENT, openerr);
+	}
+
 	// Setup the index offsets
 	dir->fd = fd;
 	dir->index_start = ctx->offset;
-	dir->index_length = header.indexsize;
+	dir->position = dir->first;
 
 	return dir;
 
@@ -184,33 +176,81 @@ openerr:
 }
 
 int xfs_readdir_r(pfs_ctx_t * ctx, pfs_dirent_t * dir, struct dirent * entry, struct dirent ** out) {
-
-	// Check to see of we're out of files
-	if (ctx->offset < dir->index_start || ctx->offset >= (dir->index_start + dir->index_length)) {
-		*out = NULL;
-		return 0;
-	}
-
-	// Read next entry index
-	if (!pfs_readindex(ctx, &ctx->entry)) {
-		return errno = EIO;
-	}
-
-	// Ensure entry bounds are within file bounds
-	if ((ctx->entry.offset + ctx->entry.length) > dir->file_length) {
-		// Entry is passed file bounds, pack file probably stripped
-		*out = NULL;
+	pfs_cache_t * cache = ctx->cache;
+
+	while (dir->position < dir->end) {
+		uint32_t index = dir->position++;
+		const char * path = pfs_cachepath(cache, index);
+
+		// Skip entries outside of the directory, only happens on unsorted indexes
+		bool root = pfs_dirroot(dir->prefix, dir->prefixlen);
+		if (!root && strncmp(path, dir->prefix, dir->prefixlen) != 0) {
+			continue;
+		}
+
+		// The leading '/' of a rooted path belongs to the root, it isn't an empty component
+		size_t skip = root? (path[0] == '/') : dir->prefixlen;
+		const char * name = &path[skip];
+		const char * seperator = strchr(name, '/');
+
+		if (seperator == NULL) {
+			// Regular entry directly within the directory
+			if (!pfs_readindex(cache, index, &ctx->entry)) {
+				return errno = EIO;
+			}
+
+			// Ensure entry bounds are within file bounds
+			if ((ctx->entry.offset + ctx->entry.length) > dir->file_length) {
+				// Entry is passed file bounds, pack file probably stripped
+				continue;
+			}
+
+			entry->d_ino = 0;
+			entry->d_type = DT_REG;
+			strlcpy(entry->d_name, name, sizeof(entry->d_name));
+
+			*out = entry;
+			return 0;
+		}
+
+		// Entry is within a subdirectory, skip empty path components
+		size_t namelen = seperator - name;
+		if (namelen == 0) {
+			continue;
+		}
+
+		// Report the subdirectory once and skip over the rest of its entries
+		size_t sublen = skip + namelen + 1;
+		if (cache->header.flags & PH_SORTEDINDEX) {
+			uint32_t first = 0, end = 0;
+			if (pfs_finddir(cache, path, sublen, &first, &end) && end > dir->position) {
+				dir->position = min(end, dir->end);
+			}
+
+		} else {
+			bool seen = false;
+			for (uint32_t i = dir->first; i < index && !seen; i++) {
+				seen = strncmp(pfs_cachepath(cache, i), path, sublen) == 0;
+			}
+
+			if (seen) {
+				continue;
+			}
+		}
+
+		entry->d_ino = 0;
+		entry->d_type = DT_DIR;
+		strlcpy(entry->d_name, name, min(namelen + 1, sizeof(entry->d_name)));
+
+		*out = entry;
 		return 0;
 	}
 
-	entry->d_ino = 0;
-	entry->d_type = DT_REG;
-	strlcpy(entry->d_name, ctx->entry.path, sizeof(entry->d_name));
-
-	*out = entry;
+	// Out of entries
+	*out = NULL;
 	return 0;
 }
 
 long xfs_telldir(pfs_ctx_t * ctx, pfs_dirent_t * dir) {
-	return (ctx->offset - dir->index_start) / sizeof(packfs_entry_t);
+	return dir->position - dir->first;
 }
@@ -0,0 +1,108 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "packfs-priv.h"
+
+// Contexts are handed out from an atomic bitmap per chunk, chunks are allocated on first use and
+// never freed so pfs_fdget never needs a lock
+
+static unsigned int pfs_fdnumchunks(unsigned int maxfiles) {
+	return min((maxfiles + PACKFS_FDCHUNK_SIZE - 1) / PACKFS_FDCHUNK_SIZE, PACKFS_FDCHUNK_MAX);
+}
+
+static uint8_t * pfs_fdchunk(pfs_fdtable_t * table, unsigned int c) {
+	uint8_t * chunk = atomic_load_explicit(&table->chunks[c], memory_order_acquire);
+	if (chunk != NULL) {
+		return chunk;
+	}
+
+	// Grow the table, lose gracefully if another task got there first
+	uint8_t * fresh = calloc(PACKFS_FDCHUNK_SIZE, table->ctxsize);
+	if (fresh == NULL) {
+		return NULL;
+	}
+
+	if (!atomic_compare_exchange_strong_explicit(&table->chunks[c], &chunk, fresh, memory_order_acq_rel, memory_order_acquire)) {
+		free(fresh);
+		return chunk;
+	}
+
+	return fresh;
+}
+
+bool pfs_fdinit(pfs_fdtable_t * table, size_t ctxsize, unsigned int maxfiles, unsigned int prealloc) {
+	memset(table, 0, sizeof(pfs_fdtable_t));
+	table->ctxsize = ctxsize;
+	table->maxfiles = min(maxfiles, PACKFS_FDCHUNK_SIZE * PACKFS_FDCHUNK_MAX);
+
+	// Preallocate the chunks needed for the configured number of files
+	for (unsigned int c = 0; c < pfs_fdnumchunks(min(prealloc, table->maxfiles)); c++) {
+		if (pfs_fdchunk(table, c) == NULL) {
+			pfs_fddeinit(table);
+			return false;
+		}
+	}
+
+	return table->maxfiles > 0;
+}
+
+void pfs_fddeinit(pfs_fdtable_t * table) {
+	for (unsigned int c = 0; c < PACKFS_FDCHUNK_MAX; c++) {
+		free(atomic_exchange(&table->chunks[c], NULL));
+		atomic_store(&table->used[c], 0);
+	}
+	table->maxfiles = 0;
+}
+
+int pfs_fdalloc(pfs_fdtable_t * table) {
+	for (unsigned int c = 0; c < pfs_fdnumchunks(table->maxfiles); c++) {
+		// Mask off slots past the mount limit in the last chunk
+		unsigned int slots = min(table->maxfiles - c * PACKFS_FDCHUNK_SIZE, PACKFS_FDCHUNK_SIZE);
+		uint32_t full = slots == 32? UINT32_MAX : ((1U << slots) - 1);
+
+		uint32_t used = atomic_load_explicit(&table->used[c], memory_order_relaxed);
+		if ((used & full) == full) {
+			continue;
+		}
+
+		uint8_t * chunk = pfs_fdchunk(table, c);
+		if (chunk == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		while ((used & full) != full) {
+			unsigned int slot = __builtin_ctz(~used);
+			if (atomic_compare_exchange_weak_explicit(&table->used[c], &used, used | (1U << slot), memory_order_acquire, memory_order_relaxed)) {
+				memset(&chunk[slot * table->ctxsize], 0, table->ctxsize);
+				return c * PACKFS_FDCHUNK_SIZE + slot;
+			}
+		}
+	}
+
+	errno = ENFILE;
+	return -1;
+}
+
+void * pfs_fdget(pfs_fdtable_t * table, int fd) {
+	if unlikely(fd < 0 || fd >= table->maxfiles) {
+		return NULL;
+	}
+
+	unsigned int c = fd / PACKFS_FDCHUNK_SIZE, slot = fd % PACKFS_FDCHUNK_SIZE;
+	if ((atomic_load_explicit(&table->used[c], memory_order_acquire) & (1U << slot)) == 0) {
+		return NULL;
+	}
+
+	return &atomic_load_explicit(&table->chunks[c], memory_order_acquire)[slot * table->ctxsize];
+}
+
+void pfs_fdfree(pfs_fdtable_t * table, int fd) {
+	if unlikely(fd < 0 || fd >= table->maxfiles) {
+		return;
+	}
+
+	unsigned int c = fd / PACKFS_FDCHUNK_SIZE, slot = fd % PACKFS_FDCHUNK_SIZE;
+	atomic_fetch_and_explicit(&table->used[c], ~(1U << slot), memory_order_release);
+}
@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
 #include <esp_err.h>
@@ -104,6 +105,7 @@ int pfs_close(int fd) {
 	if unlikely(ctx == NULL) return -1;
 
 	xfs_close(ctx);
+	pfs_freectx(fd);
 	return 0;
 }
 
@@ -188,6 +190,14 @@ int pfs_ioctl(int fd, int cmd, va_list args) {
 	return xfs_ioctl(ctx, cmd, args);
 }
 
+int packfs_entrymap(int fd, const void ** out_data, size_t * out_length) {
+	return ioctl(fd, PIOCTL_ENTRYMAP, out_data, out_length);
+}
+
+int packfs_readahead(int fd, bool enable) {
+	return ioctl(fd, PIOCTL_READAHEAD, (int)enable);
+}
+
 ssize_t xfs_read(pfs_ctx_t * ctx, void * buffer, size_t length) {
 
 	// Check if errored
@@ -251,14 +261,10 @@ int xfs_ioctl(pfs_ctx_t * ctx, int cmd, va_list args) {
 	switch (cmd) {
 		case PIOCTL_METACOUNT:
 		case PIOCTL_METAREAD:
-		case PIOCTL_METAFIND:
-
-		case PIOCTL_INDEXCOUNT:
-		case PIOCTL_INDEXREAD:
-		case PIOCTL_INDEXFIND: {
-			// Read meta size
-			packfs_header_t header;
-			if (!pfs_seekabs(ctx, 0) || !pfs_readchunk(ctx, &header, sizeof(packfs_header_t))) {
+		case PIOCTL_METAFIND: {
+			// Seek to meta section
+			uint32_t metasize = ctx->cache->header.metasize;
+			if (!pfs_seekabs(ctx, sizeof(packfs_header_t))) {
 				errnogoto(EIO, ioctlerr);
 			}
 
@@ -272,7 +278,7 @@ int xfs_ioctl(pfs_ctx_t * ctx, int cmd, va_list args) {
 						errnogoto(EINVAL, ioctlerr);
 					}
 
-					pfs_findmeta(ctx, header.metasize, NULL, out_count);
+					pfs_findmeta(ctx, metasize, NULL, out_count);
 					ret = 0;
 					break;
 				}
@@ -289,18 +295,18 @@ int xfs_ioctl(pfs_ctx_t * ctx, int cmd, va_list args) {
 					}
 
 					packfs_meta_t meta;
-					while (in_index > 0 && header.metasize > 0) {
+					while (in_index > 0 && metasize > 0) {
 						// Index into meta section
 						if (!pfs_readmeta(ctx, &meta, NULL, NULL)) {
 							errnogoto(EIO, ioctlerr);
 						}
 
-						header.metasize -= sizeof(packfs_meta_t) + meta.descsize + meta.valuesize;
+						metasize -= sizeof(packfs_meta_t) + meta.descsize + meta.valuesize;
 						in_index -= 1;
 					}
 
 					// Check to see if we've overrun meta section
-					if (header.metasize == 0) {
+					if (metasize == 0) {
 						errnogoto(EIO, ioctlerr);
 					}
 
@@ -322,60 +328,55 @@ int xfs_ioctl(pfs_ctx_t * ctx, int cmd, va_list args) {
 					}
 
 					// Find meta by name
-					ret = pfs_findmeta(ctx, header.metasize, in_key, out_index)? 1 : 0;
+					ret = pfs_findmeta(ctx, metasize, in_key, out_index)? 1 : 0;
 					break;
 				}
+			}
+			break;
+		}
 
-				case PIOCTL_INDEXCOUNT: {
-					// Read args
-					unsigned int * out_count = va_arg(args, unsigned int *);
-
-					// Sanity check args
-					if (out_count == NULL) {
-						errnogoto(EINVAL, ioctlerr);
-					}
-
-					*out_count = header.indexsize / sizeof(packfs_entry_t);
-					ret = 0;
-					break;
-				}
-				case PIOCTL_INDEXREAD: {
-					// Read args
-					unsigned int in_index = va_arg(args, unsigned int);
-					packfs_entry_t * out_entry = va_arg(args, packfs_entry_t *);
+		case PIOCTL_INDEXCOUNT: {
+			// Read args
+			unsigned int * out_count = va_arg(args, unsigned int *);
 
-					// Sanity check args
-					if (in_index > (header.indexsize / sizeof(packfs_entry_t)) || out_entry == NULL) {
-						errnogoto(EINVAL, ioctlerr);
-					}
+			// Sanity check args
+			if (out_count == NULL) {
+				errnogoto(EINVAL, ioctlerr);
+			}
 
-					// Read in meta
-					if (!pfs_seekfwd(ctx, header.metasize + in_index * sizeof(packfs_entry_t)) || !pfs_readindex(ctx, out_entry)) {
-						errnogoto(EIO, ioctlerr);
-					}
-					ret = 0;
-					break;
-				}
-				case PIOCTL_INDEXFIND: {
-					// Read args
-					const char * in_path = va_arg(args, const char *);
-					packfs_entry_t * out_entry = va_arg(args, packfs_entry_t *);
+			*out_count = ctx->cache->numentries;
+			ret = 0;
+			break;
+		}
+		case PIOCTL_INDEXREAD: {
+			// Read args
+			unsigned int in_index = va_arg(args, unsigned int);
+			packfs_entry_t * out_entry = va_arg(args, packfs_entry_t *);
 
-					// Sanity check args
-					if (in_path == NULL || strlen(in_path) > (PACKFS_MAX_INDEXPATH - 1) || out_entry == NULL) {
-						errnogoto(EINVAL, ioctlerr);
-					}
+			// Sanity check args
+			if (in_index >= ctx->cache->numentries || out_entry == NULL) {
+				errnogoto(EINVAL, ioctlerr);
+			}
 
-					// Seek to index
-					if (!pfs_seekfwd(ctx, header.metasize)) {
-						errnogoto(EIO, ioctlerr);
-					}
+			// Read in index entry
+			if (!pfs_readindex(ctx->cache, in_index, out_entry)) {
+				errnogoto(EIO, ioctlerr);
+			}
+			ret = 0;
+			break;
+		}
+		case PIOCTL_INDEXFIND: {
+			// Read args
+			const char * in_path = va_arg(args, const char *);
+			packfs_entry_t * out_entry = va_arg(args, packfs_entry_t *);
 
-					// Find meta by name
-					ret = pfs_findentry(ctx, header.metasize, in_path, out_entry)? 1 : 0;
-					break;
-				}
+			// Sanity check args
+			if (in_path == NULL || strlen(in_path) > (PACKFS_MAX_INDEXPATH - 1) || out_entry == NULL) {
+				errnogoto(EINVAL, ioctlerr);
 			}
+
+			// Find entry by path
+			ret = pfs_findentry(ctx->cache, in_path, out_entry)? 1 : 0;
 			break;
 		}
 
@@ -395,6 +396,57 @@ int xfs_ioctl(pfs_ctx_t * ctx, int cmd, va_list args) {
 			break;
 		}
 
+		case PIOCTL_ENTRYMAP: {
+			// Read args
+			const void ** out_data = va_arg(args, const void **);
+			size_t * out_length = va_arg(args, size_t *);
+
+			// Sanity check args, fd must have an entry open
+			if (out_data == NULL || out_length == NULL || ctx->entry.offset == 0) {
+				errnogoto(EINVAL, ioctlerr);
+			}
+
+			// Compressed data can't be handed out as is
+			if (ctx->entry.flags & PF_LZO) {
+				errnogoto(EFTYPE, ioctlerr);
+			}
+
+			if ((*out_data = pfs_cachemap(ctx->cache, ctx->entry.offset, ctx->entry.length)) == NULL) {
+				errnogoto(ENOTSUP, ioctlerr);
+			}
+			*out_length = ctx->entry.length;
+
+			ret = 0;
+			break;
+		}
+
+		case PIOCTL_READAHEAD: {
+			// Read args
+			int enable = va_arg(args, int);
+
+			// Sanity check args, fd must have an entry open
+			if (ctx->entry.offset == 0) {
+				errnogoto(EINVAL, ioctlerr);
+			}
+
+			// Only compressed entries have blocks to fetch ahead
+			if (!(ctx->entry.flags & PF_LZO)) {
+				errnogoto(EFTYPE, ioctlerr);
+			}
+
+#ifdef CONFIG_PACKFS_LZO_READAHEAD
+			if (!pfs_lzoreadahead(ctx, enable != 0)) {
+				errnogoto(EIO, ioctlerr);
+			}
+#else
+			(void)enable;
+			errnogoto(ENOTSUP, ioctlerr);
+#endif
+
+			ret = 0;
+			break;
+		}
+
 		default: {
 			errnogoto(EINVAL, ioctlerr);
 		}
@@ -8,6 +8,7 @@
 
 #define IMAGEFS_TAG				"IMAGEFS"
 #define IMAGEFS_DFU_TAG			"IMAGEFS_DFU"
+#define IMAGEFS_DFU_SECTORSIZE	(4096)		/* Flash sector, OTA and scratch writes are coalesced to this */
 
 
 typedef struct {
@@ -22,6 +23,7 @@ typedef struct {
 
 int ifs_newctx(void);
 ifs_ctx_t * ifs_getctx(int fd);
+void ifs_freectx(int fd);
 
 bool ifs_checkinit();
 bool ifs_imagepath(const esp_app_desc_t * app, char * path, size_t pathlen);
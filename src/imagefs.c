@@ -16,8 +16,7 @@
 
 extern const char * pprefix_path;
 
-static _lock_t ictxlock;
-static ifs_ctx_t * ictx = NULL;
+static pfs_fdtable_t ifds;
 
 imagefs_filename_t ifilename = {NULL, NULL, NULL};
 char imagefs_path[PACKFS_MAX_FULLPATH] = {0};
@@ -26,25 +25,15 @@ const char * iprefix_path = NULL;
 
 
 int ifs_newctx(void) {
-	int fd = -1;
-
-	_lock_acquire(&ictxlock);
-	{
-		for (int i=0; i<CONFIG_PACKFS_MAX_FILES; i++) {
-			if (!ictx[i].pctx.inuse) {
-				fd = i;
-				memset(&ictx[i], 0, sizeof(ifs_ctx_t));
-				ictx[i].pctx.inuse = true;
-				break;
-			}
-		}
-	}
-	_lock_release(&ictxlock);
-	return fd;
+	return pfs_fdalloc(&ifds);
 }
 
 ifs_ctx_t * ifs_getctx(int fd) {
-	return (fd < 0 || fd >= CONFIG_PACKFS_MAX_FILES)? NULL : &ictx[fd];
+	return pfs_fdget(&ifds, fd);
+}
+
+void ifs_freectx(int fd) {
+	pfs_fdfree(&ifds, fd);
 }
 
 bool ifs_checkinit() {
@@ -153,17 +142,15 @@ esp_err_t imagefs_vfs_register(imagefs_conf_t * config) {
 		return ESP_ERR_INVALID_ARG;
 	}
 
-	if ((ictx = calloc(CONFIG_PACKFS_MAX_FILES, sizeof(ifs_ctx_t))) == NULL) {
+	if (!pfs_fdinit(&ifds, sizeof(ifs_ctx_t), config->max_files > 0? config->max_files : CONFIG_PACKFS_MAX_FILES, CONFIG_PACKFS_MAX_FILES)) {
 		return ESP_ERR_NO_MEM;
 	}
 
-	_lock_init(&ictxlock);
 	imagefs_mount = strdup(config->base_path);
 
 	// Check strdup success
 	if (imagefs_mount == NULL || imagefs_filename_register(config->prefix_path, &config->filename) != ESP_OK) {
-		free(ictx);
-		ictx = NULL;
+		pfs_fddeinit(&ifds);
 		return ESP_ERR_NO_MEM;
 	}
 
@@ -187,7 +174,7 @@ esp_err_t imagefs_vfs_register(imagefs_conf_t * config) {
 			.onimgentryend = config->full_verify? ifs_verify_onimgentryend : NULL
 		};
 		bool verified = true;
-		if (packfs_process_fromfile(imagefs_path, &vcbs, &verified) != ESP_OK || !verified) {
+		if (packfs_process_fromfile(imagefs_path, IMAGEFS_VERIFY_CHUNKSIZE, &vcbs, &verified) != ESP_OK || !verified) {
 			ESP_LOGE(IMAGEFS_TAG, "Failed to verify pack file for imagefs: path=%s", imagefs_path);
 			return ESP_FAIL;
 		}
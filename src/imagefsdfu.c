@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -6,6 +7,9 @@
 #include <esp_log.h>
 #include <esp_ota_ops.h>
 #include <esp_task_wdt.h>
+#ifdef CONFIG_IMAGEFS_DFU_PIPELINE
+#include <pthread.h>
+#endif
 
 #include "packfs-priv.h"
 #include "imagefs-priv.h"
@@ -15,6 +19,34 @@
 #error "This file should NOT be included if CONFIG_PACKFS_IMAGEFS_SUPPORT is not set."
 #else
 
+#ifdef CONFIG_IMAGEFS_DFU_PIPELINE
+// Stream DFU hands image data to a writer task through a fixed set of buffers, so flash
+// erase and write stalls overlap with receiving and decoding instead of blocking them
+
+_Static_assert((CONFIG_IMAGEFS_DFU_PIPELINE_BUFSIZE % IMAGEFS_DFU_SECTORSIZE) == 0, "CONFIG_IMAGEFS_DFU_PIPELINE_BUFSIZE must be a multiple of the flash sector size");
+
+typedef struct ifs_pipebuf_t {
+	struct ifs_pipebuf_t * next;
+	size_t length;
+	uint8_t data[CONFIG_IMAGEFS_DFU_PIPELINE_BUFSIZE];
+} ifs_pipebuf_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	ifs_pipebuf_t * free;
+	ifs_pipebuf_t * head;			/* Queued for the writer, oldest first */
+	ifs_pipebuf_t * tail;
+	ifs_pipebuf_t * fill;			/* Caller only, being filled */
+	bool busy;
+	bool stop;
+	bool exited;
+	esp_err_t err;
+	esp_ota_handle_t handle;
+	ifs_pipebuf_t buffers[CONFIG_IMAGEFS_DFU_PIPELINE_BUFFERS];
+} ifs_pipe_t;
+#endif
+
 typedef struct {
 	int eerrno;
 	esp_err_t err;
@@ -22,6 +54,11 @@ typedef struct {
 	char path[PACKFS_MAX_INDEXPATH];
 	const esp_partition_t * partition;
 	esp_ota_handle_t handle;
+	uint8_t * sector;				/* OTA writes are gathered here, NULL writes straight through */
+	size_t sectorlength;
+#ifdef CONFIG_IMAGEFS_DFU_PIPELINE
+	ifs_pipe_t * pipe;				/* NULL when writing inline */
+#endif
 } ifs_dfu_t;
 
 typedef struct {
@@ -65,6 +102,165 @@ static esp_err_t ifs_descpartition(const esp_partition_t * update, esp_app_desc_
 	return err;
 }
 
+#ifdef CONFIG_IMAGEFS_DFU_PIPELINE
+static void * ifs_pipe_writer(void * arg) {
+	ifs_pipe_t * pipe = arg;
+
+	pthread_mutex_lock(&pipe->lock);
+	while (true) {
+		while (pipe->head == NULL && !pipe->stop) {
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+		}
+		if (pipe->head == NULL) {
+			// Stopped and drained
+			break;
+		}
+
+		ifs_pipebuf_t * buf = pipe->head;
+		if ((pipe->head = buf->next) == NULL) pipe->tail = NULL;
+		pipe->busy = true;
+
+		// Write without the lock, skip everything after the first failure
+		bool failed = pipe->err != ESP_OK;
+		pthread_mutex_unlock(&pipe->lock);
+		esp_err_t err = failed? ESP_OK : esp_ota_write(pipe->handle, buf->data, buf->length);
+		pthread_mutex_lock(&pipe->lock);
+
+		if (err != ESP_OK && pipe->err == ESP_OK) {
+			pipe->err = err;
+		}
+		buf->next = pipe->free;
+		pipe->free = buf;
+		pipe->busy = false;
+		pthread_cond_broadcast(&pipe->cond);
+	}
+
+	// Stop waits for this, the pipe is freed once we let go of the lock
+	pipe->exited = true;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+	return NULL;
+}
+
+static ifs_pipe_t * ifs_pipe_start(void) {
+	ifs_pipe_t * pipe = calloc(1, sizeof(ifs_pipe_t));
+	if (pipe == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->cond, NULL);
+	for (unsigned int i = 0; i < CONFIG_IMAGEFS_DFU_PIPELINE_BUFFERS; i++) {
+		pipe->buffers[i].next = pipe->free;
+		pipe->free = &pipe->buffers[i];
+	}
+
+	// Pin the writer to the other core
+	if (!pfs_threadstart(ifs_pipe_writer, pipe, "imagefs-dfu", CONFIG_IMAGEFS_DFU_PIPELINE_STACK, CONFIG_IMAGEFS_DFU_PIPELINE_PRIORITY, CONFIG_IMAGEFS_DFU_PIPELINE_CORE)) {
+		pthread_cond_destroy(&pipe->cond);
+		pthread_mutex_destroy(&pipe->lock);
+		free(pipe);
+		return NULL;
+	}
+
+	return pipe;
+}
+
+static void ifs_pipe_stop(ifs_pipe_t * pipe, bool discard) {
+	if (pipe == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pipe->lock);
+	{
+		// Writer skips whatever is still queued once err is set
+		if (discard && pipe->err == ESP_OK) {
+			pipe->err = ESP_ERR_INVALID_STATE;
+		}
+		pipe->stop = true;
+		pthread_cond_broadcast(&pipe->cond);
+
+		while (!pipe->exited) {
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+		}
+	}
+	pthread_mutex_unlock(&pipe->lock);
+
+	pthread_cond_destroy(&pipe->cond);
+	pthread_mutex_destroy(&pipe->lock);
+	free(pipe);
+}
+
+static bool ifs_pipe_full(ifs_pipe_t * pipe) {
+	bool full;
+
+	pthread_mutex_lock(&pipe->lock);
+	{
+		full = pipe->free == NULL;
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return full;
+}
+
+static void ifs_pipe_push(ifs_pipe_t * pipe) {
+	pthread_mutex_lock(&pipe->lock);
+	{
+		pipe->fill->next = NULL;
+		if (pipe->tail != NULL) pipe->tail->next = pipe->fill;
+		else pipe->head = pipe->fill;
+		pipe->tail = pipe->fill;
+		pthread_cond_broadcast(&pipe->cond);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	pipe->fill = NULL;
+}
+
+static void ifs_pipe_write(ifs_pipe_t * pipe, const uint8_t * data, size_t length) {
+	while (length > 0) {
+		if (pipe->fill == NULL) {
+			// Wait for the writer to hand a buffer back
+			pthread_mutex_lock(&pipe->lock);
+			{
+				while (pipe->free == NULL) {
+					pthread_cond_wait(&pipe->cond, &pipe->lock);
+				}
+				pipe->fill = pipe->free;
+				pipe->free = pipe->fill->next;
+			}
+			pthread_mutex_unlock(&pipe->lock);
+			pipe->fill->length = 0;
+		}
+
+		size_t bytes = min(length, sizeof(pipe->fill->data) - pipe->fill->length);
+		memcpy(&pipe->fill->data[pipe->fill->length], data, bytes);
+		pipe->fill->length += bytes;
+		data += bytes;
+		length -= bytes;
+
+		if (pipe->fill->length == sizeof(pipe->fill->data)) {
+			ifs_pipe_push(pipe);
+		}
+	}
+}
+
+static esp_err_t ifs_pipe_drain(ifs_pipe_t * pipe) {
+	if (pipe->fill != NULL && pipe->fill->length > 0) {
+		ifs_pipe_push(pipe);
+	}
+
+	esp_err_t err;
+	pthread_mutex_lock(&pipe->lock);
+	{
+		while (pipe->head != NULL || pipe->busy) {
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+		}
+		err = pipe->err;
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return err;
+}
+#endif
+
 static inline bool ifs_fileexists(const char * filepath) {
 	struct stat st;
 	return stat(filepath, &st) == 0;
@@ -105,6 +301,22 @@ static esp_err_t ifs_fixfilename(esp_app_desc_t * app, const char * filepath) {
 	return ESP_OK;
 }
 
+static esp_err_t ifs_dfu_otaflush(ifs_dfu_t * dfu) {
+	if (dfu->sectorlength == 0) {
+		return ESP_OK;
+	}
+
+	esp_err_t err = esp_ota_write(dfu->handle, dfu->sector, dfu->sectorlength);
+	dfu->sectorlength = 0;
+	return err;
+}
+
+static void ifs_dfu_otarelease(ifs_dfu_t * dfu) {
+	free(dfu->sector);
+	dfu->sector = NULL;
+	dfu->sectorlength = 0;
+}
+
 static void ifs_dfu_onerror(void * ud, const char * file, unsigned int line, packfs_proc_section_t section, int err) {
 	ESP_LOGE(IMAGEFS_DFU_TAG, "Critical Error during DFU! (file=%s, line=%u, section=%d, errno=%d)", file, line, section, err);
 	((ifs_dfu_t *)ud)->eerrno = err;
@@ -133,6 +345,20 @@ static bool ifs_dfu_onentrystart(void * ud, const packfs_entry_t * entry, uint32
 		return false;
 	}
 
+#ifdef CONFIG_IMAGEFS_DFU_PIPELINE
+	if (dfu->pipe != NULL) {
+		// Nothing is queued yet, the writer picks this up with the first buffer
+		dfu->pipe->handle = dfu->handle;
+		return true;
+	}
+#endif
+
+	// Gather writes into whole sectors, write straight through if there's no memory for one
+	if ((dfu->sector = malloc(IMAGEFS_DFU_SECTORSIZE)) == NULL) {
+		ESP_LOGW(IMAGEFS_DFU_TAG, "No memory to coalesce OTA writes, writing unbuffered");
+	}
+	dfu->sectorlength = 0;
+
 	return true;
 }
 
@@ -144,12 +370,53 @@ static void ifs_dfu_onentrydata(void * ud, const packfs_entry_t * entry, void *
 		return;
 	}
 
-	dfu->err = esp_ota_write(dfu->handle, data, length);
+#ifdef CONFIG_IMAGEFS_DFU_PIPELINE
+	if (dfu->pipe != NULL) {
+		// Writer errors come back when the image ends
+		ifs_pipe_write(dfu->pipe, data, length);
+		return;
+	}
+#endif
+
+	if (dfu->sector == NULL) {
+		dfu->err = esp_ota_write(dfu->handle, data, length);
+		return;
+	}
+
+	// Image starts on a sector boundary, so full buffers land on sector boundaries too
+	const uint8_t * bytes = data;
+	while (length > 0 && dfu->err == ESP_OK) {
+		size_t chunk = min((size_t)length, IMAGEFS_DFU_SECTORSIZE - dfu->sectorlength);
+		memcpy(&dfu->sector[dfu->sectorlength], bytes, chunk);
+		dfu->sectorlength += chunk;
+		bytes += chunk;
+		length -= chunk;
+
+		if (dfu->sectorlength == IMAGEFS_DFU_SECTORSIZE) {
+			dfu->err = ifs_dfu_otaflush(dfu);
+		}
+	}
 }
 
 static bool ifs_dfu_onimgentryend(void * ud, const packfs_entry_t * entry, uint8_t * reported_hash, uint8_t * calculated_hash, bool hash_matches) {
 	ifs_dfu_t * dfu = (ifs_dfu_t *)ud;
 
+#ifdef CONFIG_IMAGEFS_DFU_PIPELINE
+	if (dfu->pipe != NULL) {
+		// Image has to be in flash before the OTA is ended
+		esp_err_t err = ifs_pipe_drain(dfu->pipe);
+		if (dfu->err == ESP_OK && err != ESP_OK) {
+			dfu->err = err;
+		}
+	}
+#endif
+
+	// Write out the last partial sector
+	if (dfu->err == ESP_OK) {
+		dfu->err = ifs_dfu_otaflush(dfu);
+	}
+	ifs_dfu_otarelease(dfu);
+
 	// Sanity check
 	if unlikely(dfu->err != ESP_OK) {
 		return false;
@@ -218,7 +485,8 @@ esp_err_t imagefs_file_dfu(const char * file_path, const char * firmware_image_s
 			.onentrydata = ifs_dfu_onentrydata,
 			.onimgentryend = ifs_dfu_onimgentryend,
 		};
-		esp_err_t result = packfs_process_fromfile(file_path, &cbs, &dfu);
+		esp_err_t result = packfs_process_fromfile(file_path, IMAGEFS_DFU_CHUNKSIZE, &cbs, &dfu);
+		ifs_dfu_otarelease(&dfu);
 		if (result != ESP_OK || dfu.eerrno != 0 || dfu.err != ESP_OK) {
 			ESP_LOGE(IMAGEFS_DFU_TAG, "Failed DFU update. Result error %d, errno %d, nested error %d", result, dfu.eerrno, dfu.err);
 			return ESP_FAIL;
@@ -269,6 +537,25 @@ static packfs_status_t ifss_dfu_write(pfs_proc_t * proc, void * data, size_t len
 	return status;
 }
 
+#ifdef CONFIG_IMAGEFS_DFU_PIPELINE
+static bool ifss_dfu_backpressure(pfs_proc_t * proc) {
+	ifs_dfu_t * dfu = pfss_extra(pfsp_extra(proc));
+	pfs_stream_t * stream = pfsp_extra(proc);
+
+	// Hold off while the writer is behind and the caller can still load more, otherwise
+	// decoding goes ahead and waits on the writer for a buffer
+	return dfu->pipe != NULL && !stream->eof && stream->length < stream->size && ifs_pipe_full(dfu->pipe);
+}
+
+static packfs_status_t ifss_dfu_read(pfs_proc_t * proc, void * data, size_t minlength, size_t maxlength, size_t * outlength) {
+	return ifss_dfu_backpressure(proc)? PS_AGAIN : pfss_read(proc, data, minlength, maxlength, outlength);
+}
+
+static packfs_status_t ifss_dfu_span(pfs_proc_t * proc, size_t maxlength, void ** outdata, size_t * outlength) {
+	return ifss_dfu_backpressure(proc)? PS_AGAIN : pfss_span(proc, maxlength, outdata, outlength);
+}
+#endif
+
 static bool ifss_dfu_oneof(void * ud) {
 	ifs_dfu_t * dfu = ud;
 	ifss_dfu_t * sdfu = (void *)&dfu[1];
@@ -304,8 +591,15 @@ esp_err_t imagefs_stream_dfu(const char * firmware_image_subpath, bool strip_ima
 
 	// Allocate and proc structure
 	pfsp_io_t ios = {
+#ifdef CONFIG_IMAGEFS_DFU_PIPELINE
+		.read = ifss_dfu_read,
+		.write = ifss_dfu_write,
+		.span = ifss_dfu_span
+#else
 		.read = pfss_read,
-		.write = ifss_dfu_write
+		.write = ifss_dfu_write,
+		.span = pfss_span
+#endif
 	};
 	packfs_proccb_t cbs = {
 		.onerror = ifs_dfu_onerror,
@@ -315,7 +609,7 @@ esp_err_t imagefs_stream_dfu(const char * firmware_image_subpath, bool strip_ima
 		.onimgentryend = ifs_dfu_onimgentryend,
 		.oneof = ifss_dfu_oneof
 	};
-	pfs_proc_t * proc = pfss_create(IMAGEFS_DFU_STREAM_BUFSIZE, &ios, &cbs, NULL, sizeof(ifs_dfu_t) + sizeof(ifss_dfu_t));
+	pfs_proc_t * proc = pfss_create(IMAGEFS_DFU_STREAM_BUFSIZE, IMAGEFS_DFU_CHUNKSIZE, &ios, &cbs, NULL, sizeof(ifs_dfu_t) + sizeof(ifss_dfu_t));
 	if (proc == NULL) {
 		return ESP_ERR_NO_MEM;
 	}
@@ -358,6 +652,20 @@ esp_err_t imagefs_stream_dfu(const char * firmware_image_subpath, bool strip_ima
 		errgoto(ESP_FAIL, procerr);
 	}
 
+	// Have stdio gather the small stream writes into whole sectors, writes start at offset 0
+	if (setvbuf(proc->ctx.backing, NULL, _IOFBF, IMAGEFS_DFU_SECTORSIZE) != 0) {
+		ESP_LOGW(IMAGEFS_DFU_TAG, "Failed to set scratch file buffer, writing with default buffering");
+	}
+
+#ifdef CONFIG_IMAGEFS_DFU_PIPELINE
+	// Start the flash writer
+	if ((dfu->pipe = ifs_pipe_start()) == NULL) {
+		fclose(proc->ctx.backing);
+		proc->ctx.backing = NULL;
+		errgoto(ESP_ERR_NO_MEM, procerr);
+	}
+#endif
+
 	ESP_LOGI(IMAGEFS_DFU_TAG, "DFU Stream started");
 	*out_stream = (packfs_stream_t)proc;
 	return ESP_OK;
@@ -388,9 +696,28 @@ esp_err_t imagefs_stream_dfu_complete(packfs_stream_t stream) {
 		err = ESP_FAIL;
 	}
 
+#ifdef CONFIG_IMAGEFS_DFU_PIPELINE
+	// Image end drained the writer already, this only catches a stream that never got there
+	if (dfu->pipe != NULL) {
+		esp_err_t perr = ifs_pipe_drain(dfu->pipe);
+		if (dfu->err == ESP_OK && perr != ESP_OK) {
+			dfu->err = perr;
+		}
+		ifs_pipe_stop(dfu->pipe, false);
+		dfu->pipe = NULL;
+	}
+#endif
+
+	// Image end flushed the OTA sector already, this only catches a stream that never got there
+	ifs_dfu_otarelease(dfu);
+
 	// Close the backing file, make sure we always do this
 	if (proc->ctx.backing != NULL) {
-		fflush(proc->ctx.backing);
+		// Last partial sector of the scratch pack goes out here
+		if (fflush(proc->ctx.backing) != 0) {
+			ESP_LOGE(IMAGEFS_DFU_TAG, "Failed DFU update. Could not flush scratch file: errno=%d", errno);
+			err = ESP_FAIL;
+		}
 		fclose(proc->ctx.backing);
 		proc->ctx.backing = NULL;
 	}
@@ -453,6 +780,14 @@ esp_err_t imagefs_stream_dfu_cancel(packfs_stream_t stream) {
 	ifs_dfu_t * dfu = pfss_extra(pfsp_extra(proc));
 	ifss_dfu_t * sdfu = (void *)&dfu[1];
 
+#ifdef CONFIG_IMAGEFS_DFU_PIPELINE
+	// Writer must be done with the OTA handle before it's ended
+	ifs_pipe_stop(dfu->pipe, true);
+	dfu->pipe = NULL;
+#endif
+
+	ifs_dfu_otarelease(dfu);
+
 	// Close the OTA handle
 	if (dfu->handle != 0) {
 		esp_ota_end(dfu->handle);
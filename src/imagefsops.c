@@ -81,6 +81,7 @@ int ifs_close(int fd) {
 	if unlikely(ictx == NULL) return -1;
 
 	xfs_close(&ictx->pctx);
+	ifs_freectx(fd);
 	return 0;
 }
 
@@ -173,7 +174,8 @@ int ifs_ioctl(int fd, int cmd, va_list args) {
 
 	switch (cmd) {
 		case PIOCTL_CURRENTENTRY:
-		case PIOCTL_CURRENTIMGHASH: {
+		case PIOCTL_CURRENTIMGHASH:
+		case PIOCTL_ENTRYMAP: {
 			if (ictx->mode != IM_OPENENTRY) {
 				// These ioctls are only allowed on IR_ENTRYDATA
 				errno = EINVAL;
@@ -223,6 +225,17 @@ int ifs_fstat(int fd, struct stat * st) {
 }
 
 int ifs_stat(const char * path, struct stat * st) {
+	// Sanity check args
+	if (path == NULL || path[0] == '\0') {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// Indexed entries and directories are answered from the index cache
+	if (memcmp(path, IMAGEFS_PATH_META, strlen(IMAGEFS_PATH_META)) != 0) {
+		return xfs_stat(imagefs_path, path, st);
+	}
+
 	int fd = ifs_open(path, O_RDONLY, 0);
 	if (fd == -1) {
 		return -1;
@@ -265,15 +278,14 @@ DIR * ifs_opendir(const char * path) {
 	}
 
 	// Allocate dir entry
-	// TODO - match path (not just root imagefs_path)
 	pfs_dirent_t * dir = NULL;
-	if ((dir = xfs_opendir(&ictx->pctx, imagefs_path, fd)) == NULL) {
+	if ((dir = xfs_opendir(&ictx->pctx, imagefs_path, path, fd)) == NULL) {
 		ifs_close(fd);
 		return NULL;
 	}
 
-	// Rewind to beginning of meta section
-	if (!pfs_seekabs(&ictx->pctx, sizeof(packfs_header_t))) {
+	// Rewind to beginning of meta section, metas are only listed in the root directory
+	if (pfs_dirroot(dir->prefix, dir->prefixlen) && !pfs_seekabs(&ictx->pctx, sizeof(packfs_header_t))) {
 		errnogoto(EIO, openerr);
 	}
 
@@ -316,7 +328,7 @@ int ifs_readdir_r(DIR * pdir, struct dirent * entry, struct dirent ** out) {
 		// TODO - remove this functionality
 
 		// Read next meta
-		if (!pfs_readmeta(&ictx->pctx, &ictx->pctx.meta)) {
+		if (!pfs_readmeta(&ictx->pctx, &ictx->pctx.meta, NULL, NULL)) {
 			return errno = EIO;
 		}
 
@@ -369,8 +381,11 @@ long ifs_telldir(DIR * pdir) {
 	if (ictx->pctx.offset < dir->index_start) {
 		return (ictx->pctx.offset - sizeof(packfs_header_t)) / sizeof(packfs_meta_t);
 
-	} else {
+	} else if (pfs_dirroot(dir->prefix, dir->prefixlen)) {
 		return (dir->index_start - sizeof(packfs_header_t)) / sizeof(packfs_meta_t) + xfs_telldir(&ictx->pctx, dir);
+
+	} else {
+		return xfs_telldir(&ictx->pctx, dir);
 	}
 }
 
@@ -385,8 +400,8 @@ void ifs_seekdir(DIR * pdir, long offset) {
 		return;
 	}
 
-	uint32_t nummetas = (dir->index_start - sizeof(packfs_header_t)) / sizeof(packfs_meta_t);
-	uint32_t numentries = dir->index_length / sizeof(packfs_entry_t);
+	uint32_t nummetas = pfs_dirroot(dir->prefix, dir->prefixlen)? (dir->index_start - sizeof(packfs_header_t)) / sizeof(packfs_meta_t) : 0;
+	uint32_t numentries = dir->end - dir->first;
 
 	// Sanity check offset
 	if (offset > (nummetas + numentries)) {
@@ -394,12 +409,13 @@ void ifs_seekdir(DIR * pdir, long offset) {
 		return;
 	}
 
-	// Seek to offset
-	size_t bytesoffset = offset < nummetas? offset * sizeof(packfs_meta_t) : nummetas * sizeof(packfs_meta_t) + (offset - nummetas) * sizeof(packfs_entry_t);
-	if (!pfs_seekabs(&ictx->pctx, sizeof(packfs_header_t) + bytesoffset)) {
+	// Seek to offset, entries are read from the index cache
+	uint32_t seekoffset = offset < nummetas? sizeof(packfs_header_t) + offset * sizeof(packfs_meta_t) : dir->index_start;
+	if (!pfs_seekabs(&ictx->pctx, seekoffset)) {
 		errno = EIO;
 		return;
 	}
+	dir->position = dir->first + (offset < nummetas? 0 : offset - nummetas);
 }
 
 #endif
@@ -1,30 +1,190 @@
 #include <stdbool.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/lock.h>
 
 #include <esp_err.h>
 #include <esp_log.h>
 
-#include "minilzo.h"
 #include "packfs-priv.h"
 
 #ifndef CONFIG_PACKFS_LZO_SUPPORT
 #error "This file should NOT be included if CONFIG_PACKFS_LZO_SUPPORT is not set."
 #else
 
+#if CONFIG_PACKFS_LZO_BLOCKCACHE > 0
+// Slots don't grow with the largest block, bigger blocks just aren't cached
+#define PFS_BLOCKSLOTSIZE	((CONFIG_PACKFS_LZO_BLOCKCACHE_BLOCKSIZE < PACKFS_MAX_LZOBLOCK)? CONFIG_PACKFS_LZO_BLOCKCACHE_BLOCKSIZE : PACKFS_MAX_LZOBLOCK)
+
+typedef struct {
+	uint32_t id;
+	uint32_t entryoffset;
+	uint32_t block;
+	uint32_t lastused;
+	uint32_t compressed_length;
+	uint32_t uncompressed_length;
+	uint8_t data[PFS_BLOCKSLOTSIZE];
+} pfs_blockslot_t;
+
+static _lock_t blocklock;
+static pfs_blockslot_t * blockslots = NULL;
+static bool blocknomem = false;
+static uint32_t blocktick = 0;
+#endif
+static packfs_blockcache_stats_t blockstats;
+
+#ifdef CONFIG_PACKFS_LZO_INPLACE
+#define PFS_LZOBUFFERS		(1)
+#define PFS_LZOBUFFERSIZE	(PACKFS_MAX_LZOBLOCK + PACKFS_INPLACE_MARGIN(PACKFS_MAX_LZOBLOCK))
+#else
+#define PFS_LZOBUFFERS		(2)
+#define PFS_LZOBUFFERSIZE	(PACKFS_MAX_LZOBLOCK)
+#endif
+
+#ifdef CONFIG_PACKFS_LZO_POOL
+// Fixed pool of largest-block buffers carved out once at register time, so opens in steady state
+// never touch the heap. Buffers fall back to malloc only when the pool runs dry
+static _lock_t poollock;
+static uint8_t * pool = NULL;
+static uint32_t * poolused = NULL;
+static unsigned int poolslots = 0;
+
+bool pfs_lzopoolinit(unsigned int maxfiles) {
+	if (pool != NULL) {
+		return true;
+	}
+
+	unsigned int slots = CONFIG_PACKFS_LZO_POOL_SLOTS > 0? CONFIG_PACKFS_LZO_POOL_SLOTS : maxfiles * PFS_LZOBUFFERS;
+	pool = malloc((size_t)slots * PFS_LZOBUFFERSIZE);
+	poolused = calloc((slots + 31) / 32, sizeof(uint32_t));
+	if (pool == NULL || poolused == NULL) {
+		free(pool);
+		free(poolused);
+		pool = NULL;
+		poolused = NULL;
+		return false;
+	}
+
+	poolslots = slots;
+	return true;
+}
+
+void pfs_lzopooldeinit(void) {
+	free(pool);
+	free(poolused);
+	pool = NULL;
+	poolused = NULL;
+	poolslots = 0;
+}
+
+static inline bool pfs_lzopoolowns(const uint8_t * buffer) {
+	return pool != NULL && buffer >= pool && buffer < &pool[(size_t)poolslots * PFS_LZOBUFFERSIZE];
+}
+
+static uint8_t * pfs_lzopoolget(void) {
+	uint8_t * buffer = NULL;
+
+	_lock_acquire(&poollock);
+	{
+		for (unsigned int i = 0; pool != NULL && i < poolslots; i++) {
+			if ((poolused[i / 32] & (1U << (i % 32))) == 0) {
+				poolused[i / 32] |= (1U << (i % 32));
+				buffer = &pool[(size_t)i * PFS_LZOBUFFERSIZE];
+				break;
+			}
+		}
+	}
+	_lock_release(&poollock);
+	return buffer;
+}
+
+static void pfs_lzopoolput(const uint8_t * buffer) {
+	unsigned int i = (buffer - pool) / PFS_LZOBUFFERSIZE;
+
+	_lock_acquire(&poollock);
+	{
+		poolused[i / 32] &= ~(1U << (i % 32));
+	}
+	_lock_release(&poollock);
+}
+#endif
+
+static uint8_t * pfs_lzoalloc(uint8_t * buffer, size_t size) {
+#ifdef CONFIG_PACKFS_LZO_POOL
+	// Pool buffers fit the largest block, keep them across entries
+	if (buffer != NULL && pfs_lzopoolowns(buffer)) {
+		return buffer;
+	}
+
+	uint8_t * pooled = NULL;
+	if (buffer == NULL && (pooled = pfs_lzopoolget()) != NULL) {
+		return pooled;
+	}
+#endif
+
+	return (buffer == NULL)? malloc(size) : realloc(buffer, size);
+}
+
+static void pfs_lzorelease(uint8_t * buffer) {
+#ifdef CONFIG_PACKFS_LZO_POOL
+	if (pfs_lzopoolowns(buffer)) {
+		pfs_lzopoolput(buffer);
+		return;
+	}
+#endif
+
+	free(buffer);
+}
+
+#ifdef CONFIG_PACKFS_LZO_READAHEAD
+static void pfs_lzoaheadfree(pfs_ctx_t * ctx) {
+	// Worker may still be filling the buffer
+	pfs_aheadcancel(&ctx->lzo.ahead);
+	ctx->lzo.ahead.pending = false;
+	if (ctx->lzo.ahead.buffer != NULL) {
+		pfs_lzorelease(ctx->lzo.ahead.buffer);
+		ctx->lzo.ahead.buffer = NULL;
+	}
+	ctx->lzo.readahead = false;
+}
+#endif
+
+#ifdef CONFIG_PACKFS_LZO_INPLACE
+static inline size_t pfs_lzobuffersize(pfs_ctx_t * ctx) {
+	return (size_t)ctx->lzo.header.blocksize + PACKFS_INPLACE_MARGIN(ctx->lzo.header.blocksize);
+}
+
 bool pfs_lzomalloc(pfs_ctx_t * ctx) {
-	if (ctx->lzo.block.compressed == NULL) {
-		ctx->lzo.block.compressed = malloc(ctx->lzo.header.blocksize);
-	} else {
-		ctx->lzo.block.compressed = realloc(ctx->lzo.block.compressed, ctx->lzo.header.blocksize);
+	// One buffer, compressed blocks are read into its tail and decoded toward the head
+	ctx->lzo.block.uncompressed = pfs_lzoalloc(ctx->lzo.block.uncompressed, pfs_lzobuffersize(ctx));
+	ctx->lzo.block.compressed = ctx->lzo.block.uncompressed;
+
+	ctx->lzo.block.compressed_length = 0;
+	ctx->lzo.block.uncompressed_offset = ctx->lzo.block.uncompressed_length = 0;
+	if unlikely(ctx->lzo.block.uncompressed == NULL) {
+		pfs_lzofree(ctx);
+		return false;
 	}
 
-	if (ctx->lzo.block.uncompressed == NULL) {
-		ctx->lzo.block.uncompressed = malloc(ctx->lzo.header.blocksize);
-	} else {
-		ctx->lzo.block.uncompressed = realloc(ctx->lzo.block.uncompressed, ctx->lzo.header.blocksize);
+	return true;
+}
+
+void pfs_lzofree(pfs_ctx_t * ctx) {
+#ifdef CONFIG_PACKFS_LZO_READAHEAD
+	pfs_lzoaheadfree(ctx);
+#endif
+	if (ctx->lzo.block.uncompressed != NULL) {
+		pfs_lzorelease(ctx->lzo.block.uncompressed);
+		ctx->lzo.block.uncompressed = NULL;
 	}
+	ctx->lzo.block.compressed = NULL;
+}
+#else
+bool pfs_lzomalloc(pfs_ctx_t * ctx) {
+	ctx->lzo.block.compressed = pfs_lzoalloc(ctx->lzo.block.compressed, ctx->lzo.header.blocksize);
+	ctx->lzo.block.uncompressed = pfs_lzoalloc(ctx->lzo.block.uncompressed, ctx->lzo.header.blocksize);
 
 	ctx->lzo.block.compressed_length = 0;
 	ctx->lzo.block.uncompressed_offset = ctx->lzo.block.uncompressed_length = 0;
@@ -37,15 +197,19 @@ bool pfs_lzomalloc(pfs_ctx_t * ctx) {
 }
 
 void pfs_lzofree(pfs_ctx_t * ctx) {
+#ifdef CONFIG_PACKFS_LZO_READAHEAD
+	pfs_lzoaheadfree(ctx);
+#endif
 	if (ctx->lzo.block.compressed != NULL) {
-		free(ctx->lzo.block.compressed);
+		pfs_lzorelease(ctx->lzo.block.compressed);
 		ctx->lzo.block.compressed = NULL;
 	}
 	if (ctx->lzo.block.uncompressed != NULL) {
-		free(ctx->lzo.block.uncompressed);
+		pfs_lzorelease(ctx->lzo.block.uncompressed);
 		ctx->lzo.block.uncompressed = NULL;
 	}
 }
+#endif
 
 static inline size_t pfs_lzoposition(pfs_ctx_t * ctx) {
 	return (ctx->lzo.numblocks == 0)? 0 : (size_t)(ctx->lzo.numblocks - 1) * (size_t)ctx->lzo.header.blocksize + (size_t)ctx->lzo.block.uncompressed_offset;
@@ -57,13 +221,23 @@ bool pfs_preplzo(pfs_ctx_t * ctx) {
 	ctx->lzo.block.compressed_length = 0;
 	ctx->lzo.block.uncompressed_offset = 0;
 	ctx->lzo.block.uncompressed_length = 0;
+	ctx->lzo.block.direct = false;
 
 	return true;
 }
 
+static inline uint32_t pfs_lzonumblocks(pfs_ctx_t * ctx) {
+	return (ctx->lzo.header.uncompressed_length + ctx->lzo.header.blocksize - 1) / ctx->lzo.header.blocksize;
+}
+
 bool pfs_checklzoheader(pfs_ctx_t * ctx) {
-	// Check for sane blocksize
-	if (ctx->lzo.header.blocksize > PACKFS_MAX_LZOBLOCK) {
+	// Narrow headers only fill the low half of blocksize
+	if (!(ctx->entry.flags & PF_LZOWIDE)) {
+		ctx->lzo.header.blocksize &= UINT16_MAX;
+	}
+
+	// Check for sane blocksize and a codec we were built with
+	if (ctx->lzo.header.blocksize == 0 || ctx->lzo.header.blocksize > PACKFS_MAX_LZOBLOCK || pfs_codecfind(ctx->entry.flags) == NULL) {
 		pfs_error(ctx) = true;
 		return false;
 	}
@@ -71,76 +245,412 @@ bool pfs_checklzoheader(pfs_ctx_t * ctx) {
 	return true;
 }
 
+uint32_t pfs_lzotablesize(pfs_ctx_t * ctx) {
+	return (ctx->entry.flags & PF_LZOTABLE)? pfs_lzonumblocks(ctx) * sizeof(uint32_t) : 0;
+}
+
 bool pfs_readlzoheader(pfs_ctx_t * ctx) {
 	// Read lzo header
-	if (!pfs_readchunk(ctx, &ctx->lzo.header, sizeof(pfs_lzoheader_t))) {
+	if (!pfs_readchunk(ctx, &ctx->lzo.header, pfs_lzoheadersize(ctx->entry.flags)) || !pfs_checklzoheader(ctx)) {
+		return false;
+	}
+
+	// Skip over the block offset table, it's only read when seeking
+	if (pfs_lzotablesize(ctx) > 0 && !pfs_seekfwd(ctx, pfs_lzotablesize(ctx))) {
 		return false;
 	}
 
-	return pfs_checklzoheader(ctx);
+	return true;
+}
+
+static inline uint32_t pfs_lzoblocklength(pfs_ctx_t * ctx) {
+	// Uncompressed length of the next block, only the last one is short
+	return min((uint32_t)ctx->lzo.header.blocksize, (uint32_t)ctx->lzo.header.uncompressed_length - (uint32_t)ctx->lzo.numblocks * (uint32_t)ctx->lzo.header.blocksize);
 }
 
-bool pfs_decompresslzoblock(pfs_ctx_t * ctx) {
+bool pfs_lzodecode(uint8_t flags, const uint8_t * in, uint32_t inlen, uint8_t * out, uint32_t outlen) {
+	// Handle incompressible block, buffers overlap when decoding in place
+	if (inlen == outlen) {
+		memmove(out, in, outlen);
+		return true;
+	}
+
+	// Decompress with the entry's codec
+	const pfs_codec_t * codec = pfs_codecfind(flags);
+	size_t len = outlen;
+	if (codec == NULL || !codec->decode(in, inlen, out, &len)) {
+		//ESP_LOGE(PACKFS_TAG, "Decompress failure: codec=%s", codec != NULL? codec->name : "none");
+		return false;
+	}
+
+	// Double check lengths
+	return len == outlen;
+}
+
+bool pfs_decompresslzoblock(pfs_ctx_t * ctx, uint8_t * dest) {
 	// Determine sizes and update internal pointers
-	uint16_t uncompressed_len = min((uint32_t)ctx->lzo.header.blocksize, (uint32_t)ctx->lzo.header.uncompressed_length - (uint32_t)ctx->lzo.numblocks * (uint32_t)ctx->lzo.header.blocksize);
+	uint32_t uncompressed_len = pfs_lzoblocklength(ctx);
 	ctx->lzo.numblocks += 1;
 	ctx->lzo.block.uncompressed_offset = 0;
 	ctx->lzo.block.uncompressed_length = uncompressed_len;
 
-	// Handle incompressible block
-	if (uncompressed_len == ctx->lzo.block.compressed_length) {
-		memcpy(ctx->lzo.block.uncompressed, ctx->lzo.block.compressed, uncompressed_len);
-		return true;
+	return pfs_lzodecode(ctx->entry.flags, ctx->lzo.block.compressed, ctx->lzo.block.compressed_length, dest, uncompressed_len);
+}
+
+bool pfs_checklzoblock(pfs_ctx_t * ctx) {
+	if (!(ctx->entry.flags & PF_LZOWIDE)) {
+		ctx->lzo.block.compressed_length &= UINT16_MAX;
 	}
 
-	// Decompress
-	lzo_uint outlen = uncompressed_len;
-	int ret = lzo1x_decompress_safe(ctx->lzo.block.compressed, ctx->lzo.block.compressed_length, ctx->lzo.block.uncompressed, &outlen, NULL);
-	if (ret != LZO_E_OK) {
-		//ESP_LOGE(PACKFS_TAG, "Decompress failure: code=%d, block=%d", ret, ctx->lzo.numblocks - 1);
+	// Verify block size is sane
+	if (ctx->lzo.block.compressed_length > ctx->lzo.header.blocksize) {
 		return false;
 	}
 
-	// Double check lengths
-	if (uncompressed_len != outlen) {
-		return false;
+#ifdef CONFIG_PACKFS_LZO_INPLACE
+	// Compressed block goes at the tail of the buffer, the builder guarantees the margin
+	if (ctx->lzo.block.uncompressed != NULL) {
+		ctx->lzo.block.compressed = &ctx->lzo.block.uncompressed[pfs_lzobuffersize(ctx) - ctx->lzo.block.compressed_length];
 	}
+#endif
 
 	return true;
 }
 
-bool pfs_checklzoblock(pfs_ctx_t * ctx) {
-	// Verify block size is sane
-	if (ctx->lzo.block.compressed_length > ctx->lzo.header.blocksize) {
+#if CONFIG_PACKFS_LZO_BLOCKCACHE > 0
+static bool pfs_blockcacheget(pfs_ctx_t * ctx, uint8_t * dest) {
+	pfs_blockslot_t * slot = NULL;
+	uint32_t block = ctx->lzo.numblocks;
+
+	_lock_acquire(&blocklock);
+	{
+		for (unsigned int i = 0; blockslots != NULL && i < CONFIG_PACKFS_LZO_BLOCKCACHE; i++) {
+			pfs_blockslot_t * s = &blockslots[i];
+			if (s->id == ctx->cache->id && s->entryoffset == ctx->entry.offset && s->block == block) {
+				slot = s;
+				break;
+			}
+		}
+
+		if (slot != NULL) {
+			// Copy out while holding the lock, the slot may be evicted right after
+			slot->lastused = ++blocktick;
+			memcpy(dest, slot->data, slot->uncompressed_length);
+			ctx->lzo.block.compressed_length = slot->compressed_length;
+			ctx->lzo.block.uncompressed_length = slot->uncompressed_length;
+			blockstats.hits += 1;
+		} else {
+			blockstats.misses += 1;
+		}
+	}
+	_lock_release(&blocklock);
+
+	if (slot == NULL) {
+		return false;
+	}
+
+	// Skip over the compressed block as if we had read it
+	ctx->lzo.numblocks += 1;
+	ctx->lzo.block.uncompressed_offset = 0;
+	return pfs_seekfwd(ctx, pfs_lzolengthsize(ctx->entry.flags) + ctx->lzo.block.compressed_length);
+}
+
+static void pfs_blockcacheput(pfs_ctx_t * ctx, const uint8_t * src) {
+	if (ctx->lzo.block.uncompressed_length > PFS_BLOCKSLOTSIZE) {
+		return;
+	}
+
+	_lock_acquire(&blocklock);
+	{
+		// Allocate on first use, don't retry on every block if the heap can't spare it
+		if (blockslots == NULL && !blocknomem && (blockslots = calloc(CONFIG_PACKFS_LZO_BLOCKCACHE, sizeof(pfs_blockslot_t))) == NULL) {
+			ESP_LOGW(PACKFS_TAG, "No memory for block cache, running without it: size=%u", (unsigned int)(CONFIG_PACKFS_LZO_BLOCKCACHE * sizeof(pfs_blockslot_t)));
+			blocknomem = true;
+		}
+
+		// Replace empty or least recently used slot
+		pfs_blockslot_t * slot = blockslots;
+		for (unsigned int i = 0; blockslots != NULL && i < CONFIG_PACKFS_LZO_BLOCKCACHE && slot->id != 0; i++) {
+			if (blockslots[i].id == 0 || blockslots[i].lastused < slot->lastused) {
+				slot = &blockslots[i];
+			}
+		}
+
+		if (slot != NULL) {
+			if (slot->id != 0) {
+				blockstats.evictions += 1;
+			}
+
+			slot->id = ctx->cache->id;
+			slot->entryoffset = ctx->entry.offset;
+			slot->block = ctx->lzo.numblocks - 1;
+			slot->lastused = ++blocktick;
+			slot->compressed_length = ctx->lzo.block.compressed_length;
+			slot->uncompressed_length = ctx->lzo.block.uncompressed_length;
+			memcpy(slot->data, src, ctx->lzo.block.uncompressed_length);
+		}
+	}
+	_lock_release(&blocklock);
+}
+#endif
+
+#ifdef CONFIG_PACKFS_LZO_READAHEAD
+static inline size_t pfs_aheadbuffersize(pfs_ctx_t * ctx) {
+	// Buffer is swapped into the ctx, so it has to fit whatever the ctx decodes into
+#ifdef CONFIG_PACKFS_LZO_INPLACE
+	return pfs_lzobuffersize(ctx);
+#else
+	return ctx->lzo.header.blocksize;
+#endif
+}
+
+static bool pfs_aheadtake(pfs_ctx_t * ctx, uint8_t * dest) {
+	pfs_ahead_t * ahead = &ctx->lzo.ahead;
+	if (!ahead->pending) {
+		return false;
+	}
+	ahead->pending = false;
+
+	// Seeked since the block was queued, drop it
+	if (ahead->block != ctx->lzo.numblocks || ahead->offset != ctx->offset) {
+		pfs_aheadcancel(ahead);
 		return false;
 	}
 
+	if (pfs_aheadwait(ahead) != PFS_AHEAD_READY) {
+		// Read the block ourselves, that path reports the error
+		return false;
+	}
+
+	if (dest == ctx->lzo.block.uncompressed) {
+		// Swap buffers, the old one takes the next prefetch
+		uint8_t * buffer = ahead->buffer;
+		ahead->buffer = ctx->lzo.block.uncompressed;
+		ctx->lzo.block.uncompressed = buffer;
+#ifdef CONFIG_PACKFS_LZO_INPLACE
+		ctx->lzo.block.compressed = buffer;
+#endif
+	} else {
+		memcpy(dest, ahead->buffer, ahead->uncompressed_length);
+	}
+
+	ctx->lzo.numblocks += 1;
+	ctx->lzo.block.compressed_length = ahead->compressed_length;
+	ctx->lzo.block.uncompressed_offset = 0;
+	ctx->lzo.block.uncompressed_length = ahead->uncompressed_length;
+	return pfs_seekabs(ctx, ahead->nextoffset);
+}
+
+static void pfs_aheadnext(pfs_ctx_t * ctx) {
+	pfs_ahead_t * ahead = &ctx->lzo.ahead;
+	if (ctx->cache == NULL || ahead->pending || ctx->lzo.numblocks >= pfs_lzonumblocks(ctx)) {
+		return;
+	}
+
+	if (ahead->buffer == NULL && (ahead->buffer = pfs_lzoalloc(NULL, pfs_aheadbuffersize(ctx))) == NULL) {
+		return;
+	}
+
+	ahead->cache = ctx->cache;
+	ahead->flags = ctx->entry.flags;
+	ahead->blocksize = ctx->lzo.header.blocksize;
+	ahead->block = ctx->lzo.numblocks;
+	ahead->offset = ctx->offset;
+	ahead->uncompressed_length = pfs_lzoblocklength(ctx);
+	ahead->pending = pfs_aheadqueue(ahead);
+}
+
+bool pfs_lzoreadahead(pfs_ctx_t * ctx, bool enable) {
+	if (!enable) {
+		pfs_aheadcancel(&ctx->lzo.ahead);
+		ctx->lzo.ahead.pending = false;
+	}
+
+	ctx->lzo.readahead = enable;
 	return true;
 }
+#endif
 
-static bool pfs_readlzoblock(pfs_ctx_t * ctx) {
+static bool pfs_readlzoblock(pfs_ctx_t * ctx, uint8_t * dest) {
 	// Verify work memory is allocated
 	if ((ctx->lzo.block.compressed == NULL || ctx->lzo.block.uncompressed == NULL) && !pfs_lzomalloc(ctx)) {
 		return false;
 	}
 
-	// Get compressed block size
-	if (!pfs_readchunk(ctx, &ctx->lzo.block.compressed_length, sizeof(ctx->lzo.block.compressed_length))) {
+	// Decode into the internal buffer unless the caller gave us somewhere else
+	bool direct = dest != NULL;
+	if (dest == NULL) {
+		dest = ctx->lzo.block.uncompressed;
+	}
+
+	bool loaded = false, cached = false;
+#ifdef CONFIG_PACKFS_LZO_READAHEAD
+	// The worker may have decoded this block already, internal buffer moves if it was swapped
+	if (pfs_aheadtake(ctx, dest)) {
+		loaded = true;
+		dest = direct? dest : ctx->lzo.block.uncompressed;
+	}
+#endif
+
+#if CONFIG_PACKFS_LZO_BLOCKCACHE > 0
+	// Another fd may have decompressed this block already
+	if (!loaded && ctx->cache != NULL && pfs_blockcacheget(ctx, dest)) {
+		loaded = cached = true;
+	}
+#endif
+
+	if (!loaded) {
+		// Get compressed block size
+		if (!pfs_readchunk(ctx, &ctx->lzo.block.compressed_length, pfs_lzolengthsize(ctx->entry.flags))) {
+			return false;
+		}
+
+		// Check for valid block
+		if (!pfs_checklzoblock(ctx)) {
+			return false;
+		}
+
+		// Read compressed block
+		if (!pfs_readchunk(ctx, ctx->lzo.block.compressed, ctx->lzo.block.compressed_length)) {
+			return false;
+		}
+
+		if (!pfs_decompresslzoblock(ctx, dest)) {
+			return false;
+		}
+	}
+
+#if CONFIG_PACKFS_LZO_BLOCKCACHE > 0
+	if (!cached && ctx->cache != NULL) {
+		pfs_blockcacheput(ctx, dest);
+	}
+#endif
+
+	ctx->lzo.block.direct = direct;
+
+#ifdef CONFIG_PACKFS_LZO_READAHEAD
+	// Start on the next block while the caller consumes this one
+	if (ctx->lzo.readahead) {
+		pfs_aheadnext(ctx);
+	}
+#endif
+
+	return true;
+}
+
+#ifdef CONFIG_PACKFS_LZO_PARALLEL
+static bool pfs_lzoblockoffset(pfs_ctx_t * ctx, uint32_t block, uint32_t * out_offset) {
+	// Absolute offset of a block's length prefix, from the table that follows the lzo header
+	uint32_t blockoffset = 0;
+	if (!pfs_cacheread(ctx->cache, ctx->entry.offset + pfs_lzoheadersize(ctx->entry.flags) + block * sizeof(uint32_t), &blockoffset, sizeof(uint32_t)) || blockoffset >= ctx->entry.length) {
 		return false;
 	}
 
-	// Check for valid block
-	if (!pfs_checklzoblock(ctx)) {
+	*out_offset = ctx->entry.offset + blockoffset;
+	return true;
+}
+
+static bool pfs_readlzoparallel(pfs_ctx_t * ctx, uint8_t * dest, uint32_t numblocks) {
+	pfs_decodejob_t jobs[CONFIG_PACKFS_LZO_PARALLEL_WORKERS + 1];
+	bool queued[CONFIG_PACKFS_LZO_PARALLEL_WORKERS + 1];
+	unsigned int numjobs = min(numblocks, (uint32_t)(CONFIG_PACKFS_LZO_PARALLEL_WORKERS + 1));
+	size_t lengthsize = pfs_lzolengthsize(ctx->entry.flags);
+
+	// Verify work memory is allocated, the internal buffer is our scratch
+	if ((ctx->lzo.block.compressed == NULL || ctx->lzo.block.uncompressed == NULL) && !pfs_lzomalloc(ctx)) {
+		return false;
+	}
+
+#ifdef CONFIG_PACKFS_LZO_READAHEAD
+	// Prefetched block is part of the first run
+	if (ctx->lzo.ahead.pending) {
+		pfs_aheadcancel(&ctx->lzo.ahead);
+		ctx->lzo.ahead.pending = false;
+	}
+#endif
+
+	// Find where each run starts, from the block offset table when there is one, otherwise by
+	// walking the length prefixes
+	bool table = (ctx->entry.flags & PF_LZOTABLE) != 0;
+	uint32_t blocksize = ctx->lzo.header.blocksize, total = ctx->lzo.header.uncompressed_length;
+	uint32_t offset = ctx->offset, block = ctx->lzo.numblocks, written = 0;
+	uint32_t compressed_length = 0, uncompressed_length = 0;
+	for (unsigned int j = 0; j < numjobs; j++) {
+		pfs_decodejob_t * job = &jobs[j];
+		job->cache = ctx->cache;
+		job->flags = ctx->entry.flags;
+		job->blocksize = blocksize;
+		job->numblocks = numblocks / numjobs + ((j < numblocks % numjobs)? 1 : 0);
+		job->dest = &dest[written];
+
+		if (table && j > 0 && !pfs_lzoblockoffset(ctx, block, &offset)) {
+			pfs_error(ctx) = true;
+			return false;
+		}
+		job->offset = offset;
+		job->length = min(job->numblocks * blocksize, total - block * blocksize);
+
+		for (uint32_t i = 0; !table && i < job->numblocks; i++) {
+			compressed_length = 0;
+			if (!pfs_cacheread(ctx->cache, offset, &compressed_length, lengthsize)) {
+				pfs_error(ctx) = true;
+				return false;
+			}
+			offset += lengthsize + compressed_length;
+		}
+
+		block += job->numblocks;
+		written += job->length;
+	}
+
+	// The ctx ends up past the last block, whose lengths it keeps
+	uncompressed_length = min(blocksize, total - (block - 1) * blocksize);
+	if (table) {
+		compressed_length = 0;
+		if (!pfs_lzoblockoffset(ctx, block - 1, &offset) || !pfs_cacheread(ctx->cache, offset, &compressed_length, lengthsize)) {
+			pfs_error(ctx) = true;
+			return false;
+		}
+		offset += lengthsize + compressed_length;
+	}
+
+	// Hand out every run but the first, any the pool can't take are decoded here
+	for (unsigned int j = 1; j < numjobs; j++) {
+		queued[j] = pfs_decodequeue(&jobs[j]);
+	}
+
+	bool success = pfs_decoderun(&jobs[0], ctx->lzo.block.uncompressed);
+	for (unsigned int j = 1; j < numjobs; j++) {
+		// Always wait, workers write into dest
+		if (queued[j]) {
+			success = pfs_decodewait(&jobs[j]) && success;
+		} else {
+			success = success && pfs_decoderun(&jobs[j], ctx->lzo.block.uncompressed);
+		}
+	}
+
+	if (!success) {
 		return false;
 	}
 
-	// Read compressed block
-	if (!pfs_readchunk(ctx, ctx->lzo.block.compressed, ctx->lzo.block.compressed_length)) {
+	// Leave the ctx as if the blocks were read one at a time
+	ctx->lzo.numblocks += numblocks;
+	ctx->lzo.block.compressed_length = compressed_length;
+	ctx->lzo.block.uncompressed_offset = ctx->lzo.block.uncompressed_length = uncompressed_length;
+	ctx->lzo.block.direct = true;
+	if (!pfs_seekabs(ctx, offset)) {
 		return false;
 	}
 
-	return pfs_decompresslzoblock(ctx);
+#ifdef CONFIG_PACKFS_LZO_READAHEAD
+	if (ctx->lzo.readahead) {
+		pfs_aheadnext(ctx);
+	}
+#endif
+
+	return true;
 }
+#endif
 
 ssize_t pfs_readlzo(pfs_ctx_t * ctx, void * buffer, size_t length) {
 	labels(readerr); // @suppress("Type cannot be resolved")
@@ -155,13 +665,38 @@ ssize_t pfs_readlzo(pfs_ctx_t * ctx, void * buffer, size_t length) {
 				break;
 			}
 
-			if (!pfs_readlzoblock(ctx)) {
+#ifdef CONFIG_PACKFS_LZO_PARALLEL
+			// Reads spanning many whole blocks are decoded by the workers alongside us
+			uint32_t remaining = ctx->lzo.header.uncompressed_length - pfs_lzoposition(ctx);
+			uint32_t bytes = (length >= remaining)? remaining : (uint32_t)(length / ctx->lzo.header.blocksize) * ctx->lzo.header.blocksize;
+			uint32_t numblocks = (bytes + ctx->lzo.header.blocksize - 1) / ctx->lzo.header.blocksize;
+			if (buffer != NULL && ctx->cache != NULL && numblocks >= CONFIG_PACKFS_LZO_PARALLEL_MINBLOCKS) {
+				if (!pfs_readlzoparallel(ctx, &((uint8_t *)buffer)[totalread], numblocks)) {
+					errnogoto(EIO, readerr);
+				}
+
+				totalread += bytes;
+				length -= bytes;
+				continue;
+			}
+#endif
+
+			// Whole blocks the caller wants go straight into their buffer
+			uint8_t * dest = (buffer != NULL && length >= pfs_lzoblocklength(ctx))? &((uint8_t *)buffer)[totalread] : NULL;
+			if (!pfs_readlzoblock(ctx, dest)) {
 				errnogoto(EIO, readerr);
 			}
+
+			if (ctx->lzo.block.direct) {
+				ctx->lzo.block.uncompressed_offset = ctx->lzo.block.uncompressed_length;
+				totalread += ctx->lzo.block.uncompressed_length;
+				length -= ctx->lzo.block.uncompressed_length;
+				continue;
+			}
 		}
 
 		// Copy from uncompressed block to user
-		uint16_t bytes = min(length, (size_t)ctx->lzo.block.uncompressed_length - (size_t)ctx->lzo.block.uncompressed_offset);
+		uint32_t bytes = min(length, (size_t)ctx->lzo.block.uncompressed_length - (size_t)ctx->lzo.block.uncompressed_offset);
 		if (buffer != NULL) {
 			memcpy(&((uint8_t *)buffer)[totalread], &ctx->lzo.block.uncompressed[ctx->lzo.block.uncompressed_offset], bytes);
 		}
@@ -180,12 +715,12 @@ readerr:
 
 static bool pfs_skiplzoblock(pfs_ctx_t * ctx) {
 	// Get compressed block size
-	if (!pfs_readchunk(ctx, &ctx->lzo.block.compressed_length, sizeof(uint16_t))) {
+	if (!pfs_readchunk(ctx, &ctx->lzo.block.compressed_length, pfs_lzolengthsize(ctx->entry.flags))) {
 		return false;
 	}
 
 	// Verify block size is sane
-	if (ctx->lzo.block.compressed_length > ctx->lzo.header.blocksize) {
+	if (!pfs_checklzoblock(ctx)) {
 		return false;
 	}
 
@@ -195,7 +730,7 @@ static bool pfs_skiplzoblock(pfs_ctx_t * ctx) {
 	}
 
 	// Determine sizes and update internal pointers
-	uint16_t uncompressed_len = min((uint32_t)ctx->lzo.header.blocksize, (uint32_t)ctx->lzo.header.uncompressed_length - (uint32_t)ctx->lzo.numblocks * (uint32_t)ctx->lzo.header.blocksize);
+	uint32_t uncompressed_len = pfs_lzoblocklength(ctx);
 	ctx->lzo.numblocks += 1;
 	ctx->lzo.block.uncompressed_offset = uncompressed_len;
 	ctx->lzo.block.uncompressed_length = uncompressed_len;
@@ -203,6 +738,24 @@ static bool pfs_skiplzoblock(pfs_ctx_t * ctx) {
 	return true;
 }
 
+static bool pfs_jumplzoblock(pfs_ctx_t * ctx, uint32_t block) {
+	// Look up where the block starts in the offset table
+	uint32_t blockoffset = 0;
+	if (!pfs_seekabs(ctx, ctx->entry.offset + pfs_lzoheadersize(ctx->entry.flags) + block * sizeof(uint32_t)) || !pfs_readchunk(ctx, &blockoffset, sizeof(uint32_t))) {
+		return false;
+	}
+
+	if (blockoffset >= ctx->entry.length || !pfs_seekabs(ctx, ctx->entry.offset + blockoffset)) {
+		return false;
+	}
+
+	// Load the block as if we had read up to it
+	ctx->lzo.numblocks = block;
+	ctx->lzo.block.compressed_length = 0;
+	ctx->lzo.block.uncompressed_offset = ctx->lzo.block.uncompressed_length = 0;
+	return pfs_readlzoblock(ctx, NULL);
+}
+
 off_t pfs_seekfilelzo(pfs_ctx_t * ctx, off_t offset, int mode) {
 	labels(seekerr); // @suppress("Type cannot be resolved")
 
@@ -224,11 +777,20 @@ off_t pfs_seekfilelzo(pfs_ctx_t * ctx, off_t offset, int mode) {
 		// Nothing to do, already at seek point
 		return offset;
 
-	} else if (offset >= (position - ctx->lzo.block.uncompressed_offset) && offset < (position - ctx->lzo.block.uncompressed_offset + ctx->lzo.block.uncompressed_length)) {
+	} else if (!ctx->lzo.block.direct && offset >= (position - ctx->lzo.block.uncompressed_offset) && offset < (position - ctx->lzo.block.uncompressed_offset + ctx->lzo.block.uncompressed_length)) {
 		// Offset is within current block, rewind to beginning of block
 		position -= ctx->lzo.block.uncompressed_offset;
 		ctx->lzo.block.uncompressed_offset = 0;
 
+	} else if (ctx->entry.flags & PF_LZOTABLE) {
+		// Jump straight to the block holding offset, the end of entry lands in the last block
+		uint32_t block = min((uint32_t)offset / ctx->lzo.header.blocksize, pfs_lzonumblocks(ctx) - 1);
+		if (!pfs_jumplzoblock(ctx, block)) {
+			errnogoto(EIO, seekerr);
+		}
+
+		position = block * ctx->lzo.header.blocksize;
+
 	} else if (offset < position) {
 		// Offset is behind us, rewind to beginning of entry and reset fields
 		if (!pfs_seekentry(ctx, &ctx->entry) || !pfs_prepentry(ctx)) {
@@ -240,11 +802,11 @@ off_t pfs_seekfilelzo(pfs_ctx_t * ctx, off_t offset, int mode) {
 
 	// Now seek forward in compressed file
 	while (position < offset) {
-		uint16_t bytesleft = (uint16_t)((uint32_t)offset - position);
+		uint32_t bytesleft = (uint32_t)offset - position;
 
 		if (ctx->lzo.block.uncompressed_offset < ctx->lzo.block.uncompressed_length) {
 			// Bytes left in block, seek to min(bytesleft, end of block)
-			uint16_t bytes = min(bytesleft, ctx->lzo.block.uncompressed_length - ctx->lzo.block.uncompressed_offset);
+			uint32_t bytes = min(bytesleft, ctx->lzo.block.uncompressed_length - ctx->lzo.block.uncompressed_offset);
 			ctx->lzo.block.uncompressed_offset += bytes;
 			position += bytes;
 			continue;
@@ -261,7 +823,7 @@ off_t pfs_seekfilelzo(pfs_ctx_t * ctx, off_t offset, int mode) {
 		}
 
 		// Seek position within one block. Load another block here and continue
-		if (!pfs_readlzoblock(ctx)) {
+		if (!pfs_readlzoblock(ctx, NULL)) {
 			errnogoto(EIO, seekerr);
 		}
 	}
@@ -273,8 +835,21 @@ seekerr:
 	return -1;
 }
 
-bool pfs_initlzo(void) {
-	return lzo_init() == LZO_E_OK;
+void packfs_blockcache_stats(packfs_blockcache_stats_t * out_stats, bool reset) {
+#if CONFIG_PACKFS_LZO_BLOCKCACHE > 0
+	_lock_acquire(&blocklock);
+#endif
+	{
+		if (out_stats != NULL) {
+			memcpy(out_stats, &blockstats, sizeof(packfs_blockcache_stats_t));
+		}
+		if (reset) {
+			memset(&blockstats, 0, sizeof(packfs_blockcache_stats_t));
+		}
+	}
+#if CONFIG_PACKFS_LZO_BLOCKCACHE > 0
+	_lock_release(&blocklock);
+#endif
 }
 
 #endif
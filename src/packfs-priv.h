@@ -2,6 +2,8 @@
 #define __PACKFS_PRIV_H_
 
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/lock.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <dirent.h>
@@ -11,11 +13,18 @@
 
 #include <packfs.h>
 
-#define PACKFS_VERSION			(1)
+#define PACKFS_VERSION			(2)			/* Header flags and the sections they announce */
+#define PACKFS_VERSION_MIN		(1)			/* Flat index, no header flags */
 #define PACKFS_TAG				"PACKFS"
 
 #define PACKFS_MAGIC			(0x12fc)
-#define PACKFS_PROC_BUFSIZE		(128)		/* Minimum size 32 */
+#define PACKFS_PROC_BUFSIZE		(CONFIG_PACKFS_PROCESS_CHUNKSIZE)		/* Default chunk size, minimum PACKFS_PROC_MINCHUNK */
+#define PACKFS_PROC_MINCHUNK	(32)			/* Holds a sha256 hash */
+#define PACKFS_FDCHUNK_SIZE		(8)			/* Contexts per fd table chunk, max 32 */
+#define PACKFS_FDCHUNK_MAX		(64)
+#define PACKFS_NOAFFINITY		(-1)			/* pfs_threadstart core for unpinned workers */
+#define PACKFS_HEADERFLAGS		(PH_SORTEDINDEX | PH_HASHTABLE | PH_COMPACTINDEX | PH_DIRTABLE | PH_BLOOMFILTER | PH_SIZETABLE)		/* Header flags this reader understands */
+#define PACKFS_SECTIONS			(PH_HASHTABLE | PH_DIRTABLE | PH_BLOOMFILTER | PH_SIZETABLE)		/* Header flags with a section after the index, in bit order */
 
 
 #ifdef unlikely
@@ -29,27 +38,134 @@
 #define errgoto(e, l)		({ err = e; goto l; })
 
 #define pfs_error(ctx)		((ctx)->errored)
+#define pfs_dirroot(prefix, prefixlen)	((prefixlen) == 0 || ((prefixlen) == 1 && (prefix)[0] == '/'))		/* Both "" and "/" list the whole pack */
 
 
 #ifdef CONFIG_PACKFS_LZO_SUPPORT
+// Packs store a uint16_t blocksize and block lengths unless the entry is PF_LZOWIDE
 typedef struct __packfs_packed {
 	uint32_t uncompressed_length;
-	uint16_t blocksize;
+	uint32_t blocksize;
 } pfs_lzoheader_t;
 
 typedef struct {
-	uint16_t compressed_length;
+	uint32_t compressed_length;
 	uint8_t * compressed;
-	uint16_t uncompressed_offset;
-	uint16_t uncompressed_length;
+	uint32_t uncompressed_offset;
+	uint32_t uncompressed_length;
 	uint8_t * uncompressed;
+	bool direct;			/* Current block was decoded into the caller's buffer, not uncompressed */
 } pfs_lzoblock_t;
+
+static inline size_t pfs_lzoheadersize(uint8_t flags) {
+	return (flags & PF_LZOWIDE)? sizeof(pfs_lzoheader_t) : sizeof(uint32_t) + sizeof(uint16_t);
+}
+
+static inline size_t pfs_lzolengthsize(uint8_t flags) {
+	return (flags & PF_LZOWIDE)? sizeof(uint32_t) : sizeof(uint16_t);
+}
+
+typedef struct {
+	uint8_t flag;
+	const char * name;
+	bool (*init)(void);
+	bool (*decode)(const uint8_t * in, size_t inlen, uint8_t * out, size_t * outlen);
+} pfs_codec_t;
+#endif
+
+typedef struct pfs_cache_t {
+	struct pfs_cache_t * next;
+	unsigned int refs;
+	uint32_t id;
+	bool stale;
+	char path[PACKFS_MAX_FULLPATH];
+	uint32_t length;
+	time_t mtime;
+	packfs_header_t header;
+	uint32_t numentries;
+	uint32_t numslots;
+	packfs_hashslot_t * slots;
+	uint32_t numdirs;
+	packfs_dirrange_t * dirs;
+	uint8_t bloomprobes;
+	uint32_t bloommask;
+	uint8_t * bloom;
+	packfs_sizeinfo_t * sizes;
+	const packfs_backend_t * backend;
+	void * backendud;
+	_lock_t handlelock;
+	void * handle;
+	packfs_centry_t * entries;
+	char * paths;
+	uint8_t data[0];
+} pfs_cache_t;
+
+#define pfs_cachepath(cache, i)		(&(cache)->paths[(cache)->entries[(i)].name])
+
+typedef struct {
+	bool compact;
+	const uint8_t * index;
+	const uint8_t * strtab;
+	uint32_t strtabsize;
+	uint32_t count;
+	uint32_t on;
+	size_t pathlen;
+	char path[PACKFS_MAX_INDEXPATH];
+} pfs_indexiter_t;
+
+typedef struct {
+	size_t ctxsize;
+	unsigned int maxfiles;
+	uint8_t * _Atomic chunks[PACKFS_FDCHUNK_MAX];
+	atomic_uint used[PACKFS_FDCHUNK_MAX];
+} pfs_fdtable_t;
+
+#ifdef CONFIG_PACKFS_LZO_READAHEAD
+typedef enum {
+	PFS_AHEAD_IDLE,
+	PFS_AHEAD_QUEUED,
+	PFS_AHEAD_BUSY,
+	PFS_AHEAD_READY,
+	PFS_AHEAD_FAILED,
+} pfs_aheadstate_t;
+
+// Next block of an fd, fields up to uncompressed_length are set by the fd before queueing
+typedef struct pfs_ahead_t {
+	struct pfs_ahead_t * next;
+	pfs_aheadstate_t state;		/* Guarded by the worker lock */
+	bool pending;				/* Owner only, a job is queued or done but not taken */
+	pfs_cache_t * cache;
+	uint8_t flags;
+	uint32_t blocksize;
+	uint32_t block;
+	uint32_t offset;
+	uint32_t uncompressed_length;
+	uint32_t compressed_length;
+	uint32_t nextoffset;
+	uint8_t * buffer;
+} pfs_ahead_t;
+#endif
+
+#ifdef CONFIG_PACKFS_LZO_PARALLEL
+// Contiguous run of whole blocks decoded straight into dest
+typedef struct pfs_decodejob_t {
+	struct pfs_decodejob_t * next;
+	bool done;					/* Guarded by the worker lock */
+	bool success;
+	pfs_cache_t * cache;
+	uint8_t flags;
+	uint32_t blocksize;
+	uint32_t offset;			/* Length prefix of the first block */
+	uint32_t numblocks;
+	uint32_t length;			/* Uncompressed bytes of the run */
+	uint8_t * dest;
+} pfs_decodejob_t;
 #endif
 
 typedef struct {
-	bool inuse;
 	bool errored;
 	FILE * backing;
+	pfs_cache_t * cache;
 	uint32_t offset;
 	union {
 		packfs_meta_t meta;
@@ -57,9 +173,13 @@ typedef struct {
 	};
 #ifdef CONFIG_PACKFS_LZO_SUPPORT
 	struct {
-		uint16_t numblocks;
+		uint32_t numblocks;
 		pfs_lzoheader_t header;
 		pfs_lzoblock_t block;
+#ifdef CONFIG_PACKFS_LZO_READAHEAD
+		bool readahead;
+		pfs_ahead_t ahead;
+#endif
 	} lzo;
 #endif
 } pfs_ctx_t;
@@ -68,9 +188,13 @@ typedef struct {
 	DIR dir;
 	struct dirent ent;
 	uint32_t index_start;
-	uint32_t index_length;
+	uint32_t first;
+	uint32_t end;
+	uint32_t position;
 	uint32_t file_length;
 	int fd;
+	size_t prefixlen;
+	char prefix[PACKFS_MAX_INDEXPATH];
 } pfs_dirent_t;
 
 #ifdef CONFIG_PACKFS_PROCESS_SUPPORT
@@ -80,11 +204,13 @@ typedef enum {
 	PS_READHEADER,
 	PS_READMETA,
 	PS_READINDEX,
+	PS_READSECTIONS,
 	PS_READENTRY,
 	PS_SKIPENTRY,
 	PS_READIMGHASH,
 	PS_READREGCHUNK,
 	PS_READLZOHEADER,
+	PS_READLZOTABLE,
 	PS_READLZOSIZE,
 	PS_READLZOCHUNK,
 	PS_CLOSED,
@@ -93,6 +219,7 @@ typedef enum {
 typedef struct {
 	packfs_status_t (*read)(struct pfs_proc_t * proc, void * data, size_t minlength, size_t maxlength, size_t * outlength);
 	packfs_status_t (*write)(struct pfs_proc_t * proc, void * data, size_t length);
+	packfs_status_t (*span)(struct pfs_proc_t * proc, size_t maxlength, void ** outdata, size_t * outlength);	/* Optional, consume in place */
 	//void (*close)(struct pfs_proc_t * proc);
 } pfsp_io_t;
 
@@ -109,10 +236,19 @@ typedef struct pfs_proc_t {
 	pfs_ctx_t ctx;
 	packfs_header_t header;
 	packfs_entry_t * entries;
+	size_t numentries;
 	size_t onentry;
 	packfs_proccb_t cbs;
 	pfsp_io_t ios;
+	struct {
+		const packfs_backend_t * backend;
+		void * handle;
+		uint32_t offset;
+		uint32_t length;
+	} from;
 	mbedtls_sha256_context * shactx;
+	size_t chunksize;
+	uint8_t * chunk;			/* Entry data and hashes are read through here */
 	void * userdata;
 	uint8_t extra[0];
 } pfs_proc_t;
@@ -131,21 +267,62 @@ typedef struct {
 // Inner functions
 int pfs_newctx(void);
 pfs_ctx_t * pfs_getctx(int fd);
+void pfs_freectx(int fd);
+
+// Fd table ops
+bool pfs_fdinit(pfs_fdtable_t * table, size_t ctxsize, unsigned int maxfiles, unsigned int prealloc);
+void pfs_fddeinit(pfs_fdtable_t * table);
+int pfs_fdalloc(pfs_fdtable_t * table);
+void * pfs_fdget(pfs_fdtable_t * table, int fd);
+void pfs_fdfree(pfs_fdtable_t * table, int fd);
 bool pfs_prepentry(pfs_ctx_t * ctx);
 const char * pfs_parsepath(const char * fullpath, char * root, size_t rootlen);
 FILE * pfs_openbacking(const char * backingpath, uint32_t * length);
 
+// Index cache
+pfs_cache_t * pfs_cacheget(const char * backingpath);
+void pfs_cacheput(pfs_cache_t * cache);
+bool pfs_cacheopen(pfs_cache_t * cache);
+bool pfs_cacheread(pfs_cache_t * cache, uint32_t offset, void * buffer, size_t length);
+const void * pfs_cachemap(pfs_cache_t * cache, uint32_t offset, size_t length);
+
+// Backend ops
+const packfs_backend_t * pfs_backendfind(const char * path, void ** out_ud);
+uint32_t pfs_pathhash(const char * path);
+bool pfs_indexiter_init(pfs_indexiter_t * it, const packfs_header_t * header, const uint8_t * index);
+bool pfs_indexiter_next(pfs_indexiter_t * it, packfs_entry_t * out_entry);
+
 // LZO inner functions
 #ifdef CONFIG_PACKFS_LZO_SUPPORT
+bool pfs_lzopoolinit(unsigned int maxfiles);
+void pfs_lzopooldeinit(void);
 bool pfs_lzomalloc(pfs_ctx_t * ctx);
 void pfs_lzofree(pfs_ctx_t * ctx);
 bool pfs_preplzo(pfs_ctx_t * ctx);
 bool pfs_readlzoheader(pfs_ctx_t * ctx);
-bool pfs_decompresslzoblock(pfs_ctx_t * ctx);
+uint32_t pfs_lzotablesize(pfs_ctx_t * ctx);
+bool pfs_decompresslzoblock(pfs_ctx_t * ctx, uint8_t * dest);
 ssize_t pfs_readlzo(pfs_ctx_t * ctx, void * buffer, size_t length);
 off_t pfs_seekfilelzo(pfs_ctx_t * ctx, off_t offset, int mode);
-bool pfs_initlzo(void);
+bool pfs_lzodecode(uint8_t flags, const uint8_t * in, uint32_t inlen, uint8_t * out, uint32_t outlen);
+const pfs_codec_t * pfs_codecfind(uint8_t flags);
+bool pfs_initcodecs(void);
+#ifdef CONFIG_PACKFS_LZO_READAHEAD
+bool pfs_lzoreadahead(pfs_ctx_t * ctx, bool enable);
+bool pfs_aheadqueue(pfs_ahead_t * ahead);
+pfs_aheadstate_t pfs_aheadwait(pfs_ahead_t * ahead);
+void pfs_aheadcancel(pfs_ahead_t * ahead);
 #endif
+#ifdef CONFIG_PACKFS_LZO_PARALLEL
+bool pfs_decoderun(pfs_decodejob_t * job, uint8_t * scratch);
+bool pfs_decodequeue(pfs_decodejob_t * job);
+bool pfs_decodewait(pfs_decodejob_t * job);
+#endif
+#endif
+
+// Worker threads
+typedef void * (*pfs_threadfn_t)(void * arg);
+bool pfs_threadstart(pfs_threadfn_t fn, void * arg, const char * name, uint32_t stacksize, unsigned int priority, int core);
 
 // Seek ops
 bool pfs_seekabs(pfs_ctx_t * ctx, uint32_t offset);
@@ -154,12 +331,15 @@ bool pfs_seekentry(pfs_ctx_t * ctx, packfs_entry_t * entry);
 
 // Find ops
 bool pfs_findmeta(pfs_ctx_t * ctx, uint32_t metasize, const char * key, unsigned int * out_index);
-bool pfs_findentry(pfs_ctx_t * ctx, uint32_t indexsize, const char * path, packfs_entry_t * out_entry);
+bool pfs_findindex(pfs_cache_t * cache, const char * path, uint32_t * out_index);
+bool pfs_findentry(pfs_cache_t * cache, const char * path, packfs_entry_t * out_entry);
+bool pfs_dirprefix(const char * subpath, char * prefix, size_t prefixsize, size_t * out_prefixlen);
+bool pfs_finddir(pfs_cache_t * cache, const char * prefix, size_t prefixlen, uint32_t * out_first, uint32_t * out_end);
 
 // Read ops
 bool pfs_readchunk(pfs_ctx_t * ctx, void * buffer, size_t length);
 bool pfs_readmeta(pfs_ctx_t * ctx, packfs_meta_t * meta, char * desc, uint8_t * value);
-bool pfs_readindex(pfs_ctx_t * ctx, packfs_entry_t * entry);
+bool pfs_readindex(pfs_cache_t * cache, unsigned int index, packfs_entry_t * entry);
 //bool pfs_readimghash(pfs_ctx_t * ctx, uint8_t * hash);
 
 // Write ops
@@ -180,8 +360,9 @@ ssize_t xfs_read(pfs_ctx_t * ctx, void * buffer, size_t length);
 off_t xfs_lseek(pfs_ctx_t * ctx, off_t offset, int mode);
 int xfs_ioctl(pfs_ctx_t * ctx, int cmd, va_list args);
 int xfs_fstat(pfs_ctx_t * ctx, struct stat * st);
+int xfs_stat(const char * backingpath, const char * subpath, struct stat * st);
 
-pfs_dirent_t * xfs_opendir(pfs_ctx_t * ctx, const char * path, int fd);
+pfs_dirent_t * xfs_opendir(pfs_ctx_t * ctx, const char * backingpath, const char * subpath, int fd);
 int xfs_readdir_r(pfs_ctx_t * ctx, pfs_dirent_t * dir, struct dirent * entry, struct dirent ** out);
 long xfs_telldir(pfs_ctx_t * ctx, pfs_dirent_t * dir);
 
@@ -206,7 +387,7 @@ void pfs_seekdir(DIR * pdir, long offset);
 long pfs_telldir(DIR * pdir);
 
 #ifdef CONFIG_PACKFS_PROCESS_SUPPORT
-pfs_proc_t * pfsp_malloc(void * userdata, pfsp_type_t type, pfsp_io_t * ios, packfs_proccb_t * cbs, bool hashmem, size_t extrasize);
+pfs_proc_t * pfsp_malloc(void * userdata, pfsp_type_t type, pfsp_io_t * ios, packfs_proccb_t * cbs, bool hashmem, size_t chunksize, size_t extrasize);
 void * pfsp_extra(pfs_proc_t * proc);
 void pfsp_free(pfs_proc_t * proc);
 packfs_status_t pfsp_fromfile_read(pfs_proc_t * proc, void * data, size_t minlength, size_t maxlength, size_t * outlength);
@@ -214,8 +395,9 @@ packfs_status_t pfsp_tofile_write(pfs_proc_t * proc, void * data, size_t length)
 packfs_status_t pfsp_process(pfs_proc_t * proc);
 void pfsp_close(pfs_proc_t * proc);
 #ifdef CONFIG_PACKFS_STREAM_SUPPORT
-pfs_proc_t * pfss_create(size_t size, pfsp_io_t * ios, packfs_proccb_t * cbs, void * userdata, size_t extrasize);
+pfs_proc_t * pfss_create(size_t size, size_t chunksize, pfsp_io_t * ios, packfs_proccb_t * cbs, void * userdata, size_t extrasize);
 packfs_status_t pfss_read(pfs_proc_t * proc, void * data, size_t minlength, size_t maxlength, size_t * outlength);
+packfs_status_t pfss_span(pfs_proc_t * proc, size_t maxlength, void ** outdata, size_t * outlength);
 void * pfss_extra(pfs_stream_t * stream);
 #endif
 #endif
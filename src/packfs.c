@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <stdlib.h>
 #include <alloca.h>
 
 #include <esp_log.h>
@@ -9,41 +10,25 @@
 #include "packfs-priv.h"
 
 
-static _lock_t pctxlock;
-static pfs_ctx_t * pctx = NULL;
+static pfs_fdtable_t pfds;
 
 const char * packfs_mount = NULL;
 const char * pprefix_path = NULL;
 
 int pfs_newctx(void) {
-	int fd = -1;
-
-	_lock_acquire(&pctxlock);
-	{
-		for (int i=0; i<CONFIG_PACKFS_MAX_FILES; i++) {
-			if (!pctx[i].inuse) {
-				fd = i;
-				memset(&pctx[i], 0, sizeof(pfs_ctx_t));
-				pctx[i].inuse = true;
-				break;
-			}
-		}
-	}
-	_lock_release(&pctxlock);
-	return fd;
+	return pfs_fdalloc(&pfds);
 }
 
 pfs_ctx_t * pfs_getctx(int fd) {
-	if unlikely(fd < 0 || fd >= CONFIG_PACKFS_MAX_FILES) {
-		return NULL;
-	}
+	return pfs_fdget(&pfds, fd);
+}
 
-	pfs_ctx_t * c = &pctx[fd];
-	return c->inuse? c : NULL;
+void pfs_freectx(int fd) {
+	pfs_fdfree(&pfds, fd);
 }
 
 bool pfs_checkinit(void) {
-	return pctx != NULL;
+	return pfds.maxfiles > 0;
 }
 
 bool pfs_checkheader(packfs_header_t * header) {
@@ -53,8 +38,14 @@ bool pfs_checkheader(packfs_header_t * header) {
 		return false;
 	}
 
+	// Reject layouts we don't understand, version 1 packs predate header flags
+	if ((header->flags & ~PACKFS_HEADERFLAGS) != 0 || (header->version < PACKFS_VERSION && header->flags != 0)) {
+		//ESP_LOGW(PACKFS_TAG, "Unknown header flags on pack file");
+		return false;
+	}
+
 	// Sanity check index size
-	if ((header->indexsize % sizeof(packfs_entry_t)) != 0) {
+	if (!(header->flags & PH_COMPACTINDEX) && (header->indexsize % sizeof(packfs_entry_t)) != 0) {
 		//ESP_LOGW(PACKFS_TAG, "Bad section sizes on pack file");
 		return false;
 	}
@@ -71,7 +62,9 @@ bool pfs_checkheader(packfs_header_t * header) {
 }
 
 bool pfs_readchunk(pfs_ctx_t * ctx, void * buffer, size_t length) {
-	if (pfs_error(ctx) || fread(buffer, length, 1, ctx->backing) != 1) {
+	// Opened packs read through the shared backing handle, processing reads its own file
+	bool success = ctx->cache != NULL? pfs_cacheread(ctx->cache, ctx->offset, buffer, length) : fread(buffer, length, 1, ctx->backing) == 1;
+	if (pfs_error(ctx) || !success) {
 		pfs_error(ctx) = true;
 		return false;
 	}
@@ -80,7 +73,8 @@ bool pfs_readchunk(pfs_ctx_t * ctx, void * buffer, size_t length) {
 }
 
 bool pfs_seekabs(pfs_ctx_t * ctx, uint32_t offset) {
-	if (pfs_error(ctx) || fseek(ctx->backing, offset, SEEK_SET) != 0) {
+	bool success = ctx->cache != NULL? offset <= ctx->cache->length : fseek(ctx->backing, offset, SEEK_SET) == 0;
+	if (pfs_error(ctx) || !success) {
 		pfs_error(ctx) = true;
 		return false;
 	}
@@ -113,10 +107,6 @@ bool pfs_readmeta(pfs_ctx_t * ctx, packfs_meta_t * meta, char * desc, uint8_t *
 	return true;
 }
 
-bool pfs_readindex(pfs_ctx_t * ctx, packfs_entry_t * entry) {
-	return pfs_readchunk(ctx, entry, sizeof(packfs_entry_t));
-}
-
 bool pfs_findmeta(pfs_ctx_t * ctx, uint32_t metasize, const char * key, unsigned int * out_index) {
 	packfs_meta_t meta;
 
@@ -139,21 +129,6 @@ bool pfs_findmeta(pfs_ctx_t * ctx, uint32_t metasize, const char * key, unsigned
 	return false;
 }
 
-bool pfs_findentry(pfs_ctx_t * ctx, uint32_t indexsize, const char * path, packfs_entry_t * out_entry) {
-	uint16_t entries = indexsize / sizeof(packfs_entry_t);
-	while (entries-- > 0) {
-		if (!pfs_readindex(ctx, out_entry)) {
-			return false;
-		}
-
-		if (strcmp(path, out_entry->path) == 0) {
-			return true;
-		}
-	}
-
-	return false;
-}
-
 bool pfs_prepentry(pfs_ctx_t * ctx) {
 #ifdef CONFIG_PACKFS_LZO_SUPPORT
 	if ((ctx->entry.flags & PF_LZO) && (!pfs_preplzo(ctx) || !pfs_readlzoheader(ctx))) {
@@ -169,9 +144,10 @@ const char * pfs_parsepath(const char * fullpath, char * root, size_t rootlen) {
 
 	char * subpath = strchr(fullpath, PACKFS_PATH_SEPERATOR);
 	size_t rootsize = subpath != NULL? subpath - fullpath : strlen(fullpath);
-	if (strlcpy(root, fullpath, rootsize) >= rootlen) {
+	if (rootsize >= rootlen) {
 		goto parseerr;
 	}
+	strlcpy(root, fullpath, rootsize + 1);
 
 	return subpath != NULL && subpath[1] != '\0'? subpath + 1 : NULL;
 
@@ -201,45 +177,43 @@ FILE * pfs_openbacking(const char * backingpath, uint32_t * length) {
 bool xfs_open(pfs_ctx_t * ctx, const char * backingpath, const char * subpath, uint32_t * out_length, packfs_header_t * out_header) {
 	labels(openerr); // @suppress("Type cannot be resolved")
 
-	// Allocate space
-	if (out_length == NULL) out_length = alloca(sizeof(uint32_t));
-	if (out_header == NULL) out_header = alloca(sizeof(packfs_header_t));
-
-	// Open backing file
-	if ((ctx->backing = pfs_openbacking(backingpath, out_length)) == NULL) {
-		errnogoto(ENOENT, openerr);
-	}
-
-	// Read and check header
-	if (!pfs_readchunk(ctx, out_header, sizeof(packfs_header_t)) || !pfs_checkheader(out_header)) {
-		errnogoto(EFTYPE, openerr);
-	}
-
-	// Check version
-	if (out_header->version != PACKFS_VERSION) {
-		errnogoto(EPERM, openerr);
+	// Get the parsed header and index, errno is set on failure
+	if ((ctx->cache = pfs_cacheget(backingpath)) == NULL) {
+		goto openerr;
 	}
 
-	// Skip the meta section
-	if (!pfs_seekfwd(ctx, out_header->metasize)) {
-		errnogoto(EIO, openerr);
-	}
+	if (out_length != NULL) *out_length = ctx->cache->length;
+	if (out_header != NULL) memcpy(out_header, &ctx->cache->header, sizeof(packfs_header_t));
 
+	// Look up the entry before touching the backing file so misses stay cheap
 	if (subpath != NULL) {
-		if (!pfs_findentry(ctx, out_header->indexsize, subpath, &ctx->entry)) {
+		if (!pfs_findentry(ctx->cache, subpath, &ctx->entry)) {
 			// Entry not found
 			errnogoto(ENOENT, openerr);
 		}
 
-		if ((ctx->entry.offset + ctx->entry.length) > *out_length) {
+		if ((ctx->entry.offset + ctx->entry.length) > ctx->cache->length) {
 			// Entry is passed file bounds, pack file probably stripped
 			errnogoto(ENOENT, openerr);
 		}
+	}
 
+	// Open the shared backing file
+	if (!pfs_cacheopen(ctx->cache)) {
+		errnogoto(ENOENT, openerr);
+	}
+
+	if (subpath != NULL) {
 		// Goto the start of entry and prep data fields
 		if (!pfs_seekentry(ctx, &ctx->entry) || !pfs_prepentry(ctx)) {
 			errnogoto(EIO, openerr);
 		}
+
+	} else {
+		// Goto the start of the index section
+		if (!pfs_seekabs(ctx, sizeof(packfs_header_t) + ctx->cache->header.metasize)) {
+			errnogoto(EIO, openerr);
+		}
 	}
 
 	return true;
@@ -256,12 +230,15 @@ void xfs_close(pfs_ctx_t * ctx) {
 	}
 
 #ifdef CONFIG_PACKFS_LZO_SUPPORT
-	// Free compression space
+	// Free compression space, before the cache so read-ahead is done with its handle
 	pfs_lzofree(ctx);
 #endif
 
-	// Last, mark as not used
-	ctx->inuse = false;
+	// Release the index cache
+	if (ctx->cache != NULL) {
+		pfs_cacheput(ctx->cache);
+		ctx->cache = NULL;
+	}
 }
 
 ssize_t pfs_write(int fd, const void * data, size_t size) {
@@ -273,6 +250,7 @@ ssize_t pfs_write(int fd, const void * data, size_t size) {
 }
 
 esp_err_t packfs_vfs_register(packfs_conf_t * config) {
+	labels(regerr); // @suppress("Type cannot be resolved")
 	esp_err_t err = ESP_OK;
 
 	// Sanity check system
@@ -286,25 +264,29 @@ esp_err_t packfs_vfs_register(packfs_conf_t * config) {
 	}
 
 #ifdef CONFIG_PACKFS_LZO_SUPPORT
-	if (!pfs_initlzo()) {
-		ESP_LOGE(PACKFS_TAG, "Failed to initialize lzo");
+	if (!pfs_initcodecs()) {
+		ESP_LOGE(PACKFS_TAG, "Failed to initialize codecs");
 		return ESP_FAIL;
 	}
 #endif
 
-	if ((pctx = calloc(CONFIG_PACKFS_MAX_FILES, sizeof(pfs_ctx_t))) == NULL) {
+	if (!pfs_fdinit(&pfds, sizeof(pfs_ctx_t), config->max_files > 0? config->max_files : CONFIG_PACKFS_MAX_FILES, CONFIG_PACKFS_MAX_FILES)) {
 		return ESP_ERR_NO_MEM;
 	}
 
-	_lock_init(&pctxlock);
+#ifdef CONFIG_PACKFS_LZO_POOL
+	if (!pfs_lzopoolinit(pfds.maxfiles)) {
+		ESP_LOGE(PACKFS_TAG, "Failed to allocate block buffer pool");
+		errgoto(ESP_ERR_NO_MEM, regerr);
+	}
+#endif
+
 	packfs_mount = strdup(config->base_path);
 	pprefix_path = strdup(config->prefix_path);
 
 	// Check strdup success
 	if (packfs_mount == NULL || pprefix_path == NULL) {
-		free(pctx);
-		pctx = NULL;
-		return ESP_ERR_NO_MEM;
+		errgoto(ESP_ERR_NO_MEM, regerr);
 	}
 
 	esp_vfs_t cb = {
@@ -336,8 +318,19 @@ esp_err_t packfs_vfs_register(packfs_conf_t * config) {
 	};
 	if ((err = esp_vfs_register(packfs_mount, &cb, NULL)) != ESP_OK) {
 		ESP_LOGE(PACKFS_TAG, "Unable to register packfs vfs: err=%d", err);
-		return err;
+		goto regerr;
 	}
 
 	return err;
+
+regerr:
+	// Leave nothing behind so register can be retried
+	free((void *)packfs_mount);
+	free((void *)pprefix_path);
+	packfs_mount = pprefix_path = NULL;
+#ifdef CONFIG_PACKFS_LZO_POOL
+	pfs_lzopooldeinit();
+#endif
+	pfs_fddeinit(&pfds);
+	return err;
 }
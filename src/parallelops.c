@@ -0,0 +1,133 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <esp_log.h>
+
+#include "packfs-priv.h"
+
+#ifndef CONFIG_PACKFS_LZO_PARALLEL
+#error "This file should NOT be included if CONFIG_PACKFS_LZO_PARALLEL is not set."
+#else
+
+// Blocks are independent, so a read spanning many of them is cut into contiguous runs. The
+// caller decodes the first run and the workers the rest, all straight into the caller's buffer
+
+static pthread_mutex_t decodelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decodecond = PTHREAD_COND_INITIALIZER;
+static pfs_decodejob_t * decodequeue = NULL;
+static unsigned int decodeworkers = 0;
+
+bool pfs_decoderun(pfs_decodejob_t * job, uint8_t * scratch) {
+	size_t lengthsize = pfs_lzolengthsize(job->flags);
+	uint32_t offset = job->offset, written = 0;
+
+	for (uint32_t i = 0; i < job->numblocks; i++) {
+		// Same checks as pfs_readlzoblock, every block but the entry's last is full
+		uint32_t compressed_length = 0, uncompressed_length = min(job->blocksize, job->length - written);
+		if (!pfs_cacheread(job->cache, offset, &compressed_length, lengthsize) || compressed_length > job->blocksize) {
+			return false;
+		}
+
+		if (!pfs_cacheread(job->cache, offset + lengthsize, scratch, compressed_length)) {
+			return false;
+		}
+
+		if (!pfs_lzodecode(job->flags, scratch, compressed_length, &job->dest[written], uncompressed_length)) {
+			return false;
+		}
+
+		offset += lengthsize + compressed_length;
+		written += uncompressed_length;
+	}
+
+	return true;
+}
+
+static void * pfs_decodeworker(void * arg) {
+	uint8_t * scratch = arg;
+
+	pthread_mutex_lock(&decodelock);
+	while (true) {
+		while (decodequeue == NULL) {
+			pthread_cond_wait(&decodecond, &decodelock);
+		}
+
+		pfs_decodejob_t * job = decodequeue;
+		decodequeue = job->next;
+		job->next = NULL;
+
+		// Decode without the lock, owners wait for done before touching the job
+		pthread_mutex_unlock(&decodelock);
+		bool success = pfs_decoderun(job, scratch);
+		pthread_mutex_lock(&decodelock);
+
+		job->success = success;
+		job->done = true;
+		pthread_cond_broadcast(&decodecond);
+	}
+
+	return NULL;
+}
+
+static bool pfs_decodestart(void) {
+	if (decodeworkers == CONFIG_PACKFS_LZO_PARALLEL_WORKERS) {
+		return true;
+	}
+
+	// Each worker owns one compressed buffer, leave them unpinned so they land on whichever core
+	// the caller isn't using
+	while (decodeworkers < CONFIG_PACKFS_LZO_PARALLEL_WORKERS) {
+		uint8_t * scratch = malloc(PACKFS_MAX_LZOBLOCK);
+		if (scratch == NULL) {
+			break;
+		}
+
+		if (!pfs_threadstart(pfs_decodeworker, scratch, "packfs-decode", CONFIG_PACKFS_LZO_PARALLEL_STACK, CONFIG_PACKFS_LZO_PARALLEL_PRIORITY, PACKFS_NOAFFINITY)) {
+			free(scratch);
+			break;
+		}
+
+		decodeworkers += 1;
+	}
+
+	// Run with however many workers came up
+	return decodeworkers > 0;
+}
+
+bool pfs_decodequeue(pfs_decodejob_t * job) {
+	bool success = false;
+
+	pthread_mutex_lock(&decodelock);
+	{
+		if ((success = pfs_decodestart())) {
+			// Append so runs start in the order they were handed out
+			pfs_decodejob_t ** link = &decodequeue;
+			while (*link != NULL) link = &(*link)->next;
+
+			job->next = NULL;
+			job->done = job->success = false;
+			*link = job;
+			pthread_cond_broadcast(&decodecond);
+		}
+	}
+	pthread_mutex_unlock(&decodelock);
+	return success;
+}
+
+bool pfs_decodewait(pfs_decodejob_t * job) {
+	bool success;
+
+	pthread_mutex_lock(&decodelock);
+	{
+		while (!job->done) {
+			pthread_cond_wait(&decodecond, &decodelock);
+		}
+		success = job->success;
+	}
+	pthread_mutex_unlock(&decodelock);
+	return success;
+}
+
+#endif
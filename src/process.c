@@ -15,17 +15,23 @@ void * pfsp_extra(pfs_proc_t * proc) {
 	return proc != NULL? proc->extra : NULL;
 }
 
-pfs_proc_t * pfsp_malloc(void * userdata, pfsp_type_t type, pfsp_io_t * ios, packfs_proccb_t * cbs, bool hashmem, size_t extrasize) {
+pfs_proc_t * pfsp_malloc(void * userdata, pfsp_type_t type, pfsp_io_t * ios, packfs_proccb_t * cbs, bool hashmem, size_t chunksize, size_t extrasize) {
 	// Check args
-	if unlikely(ios == NULL || ios->read == NULL) {
+	if (chunksize == 0) {
+		chunksize = PACKFS_PROC_BUFSIZE;
+	}
+	if unlikely(ios == NULL || ios->read == NULL || chunksize < PACKFS_PROC_MINCHUNK) {
 		return NULL;
 	}
 
-	// Allocate memory
-	pfs_proc_t * proc = calloc(1, sizeof(pfs_proc_t) + extrasize + (hashmem? sizeof(mbedtls_sha256_context) : 0));
+	// Allocate memory, chunk buffer goes last
+	size_t hashsize = hashmem? sizeof(mbedtls_sha256_context) : 0;
+	pfs_proc_t * proc = calloc(1, sizeof(pfs_proc_t) + extrasize + hashsize + chunksize);
 	if (proc == NULL) {
 		return NULL;
 	}
+	proc->chunksize = chunksize;
+	proc->chunk = &((uint8_t *)proc)[sizeof(pfs_proc_t) + extrasize + hashsize];
 
 	// Initialize internal vars
 	proc->type = type;
@@ -46,6 +52,42 @@ pfs_proc_t * pfsp_malloc(void * userdata, pfsp_type_t type, pfsp_io_t * ios, pac
 	return proc;
 }
 
+static int pfsp_entrycmp(const void * a, const void * b) {
+	uint32_t aoffset = ((const packfs_entry_t *)a)->offset;
+	uint32_t boffset = ((const packfs_entry_t *)b)->offset;
+	return (aoffset > boffset) - (aoffset < boffset);
+}
+
+static bool pfsp_expandindex(pfs_proc_t * proc) {
+	pfs_indexiter_t it;
+	if (!pfs_indexiter_init(&it, &proc->header, (uint8_t *)proc->entries)) {
+		return false;
+	}
+
+	if (!it.compact) {
+		// Already in expanded form
+		proc->numentries = it.count;
+		return true;
+	}
+
+	packfs_entry_t * entries = calloc(it.count, sizeof(packfs_entry_t));
+	if (entries == NULL) {
+		return false;
+	}
+
+	for (uint32_t i = 0; i < it.count; i++) {
+		if (!pfs_indexiter_next(&it, &entries[i])) {
+			free(entries);
+			return false;
+		}
+	}
+
+	free(proc->entries);
+	proc->entries = entries;
+	proc->numentries = it.count;
+	return true;
+}
+
 void pfsp_free(pfs_proc_t * proc) {
 	if unlikely(proc == NULL) return;
 
@@ -88,12 +130,13 @@ packfs_status_t pfsp_process(pfs_proc_t * proc) {
 
 	packfs_status_t status = PS_OK;
 	pfs_ctx_t * ctx = &proc->ctx;
-	uint8_t tmpbuffer[PACKFS_PROC_BUFSIZE];
+	uint8_t * tmpbuffer = proc->chunk;
 
 	while (status == PS_OK) {
 		// Determine the sizes to read
 		size_t readmin = 0, readmax = 0;
 		void * readbuffer = NULL;
+		bool spannable = false;
 		switch (proc->state) {
 			case PS_READHEADER: {
 				// Must read in entire header
@@ -115,6 +158,14 @@ packfs_status_t pfsp_process(pfs_proc_t * proc) {
 				readbuffer = ((uint8_t *)proc->entries) + (ctx->offset - start);
 				break;
 			}
+			case PS_READSECTIONS: {
+				// Read through the optional sections up to the first entry
+				readmin = 1;
+				readmax = min(proc->chunksize, proc->entries[0].offset - ctx->offset);
+				readbuffer = tmpbuffer;
+				spannable = true;
+				break;
+			}
 			case PS_READENTRY: {
 				// Nothing to read here, continue process at bottom
 				readmin = readmax = 0;
@@ -133,20 +184,29 @@ packfs_status_t pfsp_process(pfs_proc_t * proc) {
 			case PS_READREGCHUNK: {
 				// Read as much as possible up to end of entry
 				readmin = 1;
-				readmax = min(PACKFS_PROC_BUFSIZE, ctx->entry.length - (ctx->offset - ctx->entry.offset));
+				readmax = min(proc->chunksize, ctx->entry.length - (ctx->offset - ctx->entry.offset));
 				readbuffer = tmpbuffer;
+				spannable = true;
 				break;
 			}
 #ifdef CONFIG_PACKFS_LZO_SUPPORT
 			case PS_READLZOHEADER: {
 				// Read in lzoheader
-				readmin = readmax = sizeof(pfs_lzoheader_t);
+				readmin = readmax = pfs_lzoheadersize(ctx->entry.flags);
 				readbuffer = &ctx->lzo.header;
 				break;
 			}
+			case PS_READLZOTABLE: {
+				// Block offset table is only used for seeking, read through it
+				readmin = 1;
+				readmax = min(proc->chunksize, ctx->entry.offset + pfs_lzoheadersize(ctx->entry.flags) + pfs_lzotablesize(ctx) - ctx->offset);
+				readbuffer = tmpbuffer;
+				spannable = true;
+				break;
+			}
 			case PS_READLZOSIZE: {
 				// Read in size of block
-				readmin = readmax = sizeof(uint16_t);
+				readmin = readmax = pfs_lzolengthsize(ctx->entry.flags);
 				readbuffer = &ctx->lzo.block.compressed_length;
 				break;
 			}
@@ -163,6 +223,7 @@ packfs_status_t pfsp_process(pfs_proc_t * proc) {
 				readbuffer = tmpbuffer;
 				break;
 			}
+			case PS_READLZOTABLE:
 			case PS_READLZOSIZE:
 			case PS_READLZOCHUNK: {
 				errorreturn(EPROTO);
@@ -178,7 +239,12 @@ packfs_status_t pfsp_process(pfs_proc_t * proc) {
 		// Read the bytes in
 		uint32_t bytes = 0;
 		if (readmax > 0) {
-			status = proc->ios.read(proc, readbuffer, readmin, readmax, &bytes);
+			if (spannable && proc->ios.span != NULL) {
+				// Bytes needn't be contiguous, use them where they sit in the source
+				status = proc->ios.span(proc, readmax, &readbuffer, &bytes);
+			} else {
+				status = proc->ios.read(proc, readbuffer, readmin, readmax, &bytes);
+			}
 
 			if (status == PS_OK && bytes < readmin) {
 				// Invalid state, must read at least readmin to have status PS_OK
@@ -203,8 +269,8 @@ packfs_status_t pfsp_process(pfs_proc_t * proc) {
 					errorreturn(EFTYPE);
 				}
 
-				// Allocate extry index size
-				if ((proc->entries = calloc(proc->header.indexsize / sizeof(packfs_entry_t), sizeof(packfs_entry_t))) == NULL) {
+				// Allocate extry index size, a compact index is read raw and expanded afterwards
+				if ((proc->entries = calloc(1, proc->header.indexsize)) == NULL) {
 					errorreturn(ENOMEM);
 				}
 
@@ -241,7 +307,27 @@ packfs_status_t pfsp_process(pfs_proc_t * proc) {
 
 				// Advance state
 				if (ctx->offset == (sizeof(packfs_header_t) + proc->header.metasize + proc->header.indexsize)) {
+					// Expand compact index
+					if (!pfsp_expandindex(proc)) {
+						errorreturn(EFTYPE);
+					}
+
+					// Entries are processed in file order, a sorted index needs to be put back in that order
+					if (proc->header.flags & PH_SORTEDINDEX) {
+						qsort(proc->entries, proc->numentries, sizeof(packfs_entry_t), pfsp_entrycmp);
+					}
+
 					proc->section = PS_REGENTRY;
+					proc->state = (proc->header.flags & PACKFS_SECTIONS) && proc->numentries > 0 && ctx->offset < proc->entries[0].offset? PS_READSECTIONS : PS_READENTRY;
+				}
+				break;
+			}
+			case PS_READSECTIONS: {
+				// Sections are covered by the index hash
+				addhash(wanthash_head());
+
+				// Advance state
+				if (ctx->offset == proc->entries[0].offset) {
 					proc->state = PS_READENTRY;
 				}
 				break;
@@ -383,7 +469,17 @@ packfs_status_t pfsp_process(pfs_proc_t * proc) {
 				}
 
 				// Advance state
-				proc->state = PS_READLZOSIZE;
+				proc->state = pfs_lzotablesize(ctx) > 0? PS_READLZOTABLE : PS_READLZOSIZE;
+				break;
+			}
+			case PS_READLZOTABLE: {
+				// Add bytes to hash
+				addhash(wanthash_body());
+
+				// Advance state
+				if (ctx->offset == (ctx->entry.offset + pfs_lzoheadersize(ctx->entry.flags) + pfs_lzotablesize(ctx))) {
+					proc->state = PS_READLZOSIZE;
+				}
 				break;
 			}
 			case PS_READLZOSIZE: {
@@ -412,7 +508,7 @@ packfs_status_t pfsp_process(pfs_proc_t * proc) {
 					uint32_t offset = ctx->lzo.numblocks * ctx->lzo.header.blocksize;
 
 					// Decompress block
-					if (!pfs_decompresslzoblock(ctx)) {
+					if (!pfs_decompresslzoblock(ctx, ctx->lzo.block.uncompressed)) {
 						errorreturn(EINVAL);
 					}
 
@@ -521,15 +617,16 @@ void pfsp_close(pfs_proc_t * proc) {
 }
 
 packfs_status_t pfsp_fromfile_read(pfs_proc_t * proc, void * data, size_t minlength, size_t maxlength, size_t * outlength) {
-	// Since we're reading from a file with all the data, we should be able to read maxlength
-	size_t read = fread(data, maxlength, 1, proc->ctx.backing);
-	if (read == 0 && feof(proc->ctx.backing) != 0) {
+	// Since we're reading from a backend with all the data, we should be able to read maxlength
+	size_t length = min(maxlength, proc->from.length - proc->from.offset);
+	if (length == 0 || length < minlength) {
 		//ESP_LOGI(PACKFS_TAG, ">> EOF");
 		return PS_EOF;
 
-	} else if (read == 1) {
-		//ESP_LOGI(PACKFS_TAG, ">%zu", maxlength);
-		*outlength = maxlength;
+	} else if (proc->from.backend->readat(proc->from.handle, proc->from.offset, data, length)) {
+		//ESP_LOGI(PACKFS_TAG, ">%zu", length);
+		proc->from.offset += length;
+		*outlength = length;
 		return PS_OK;
 
 	} else {
@@ -542,19 +639,22 @@ packfs_status_t pfsp_tofile_write(pfs_proc_t * proc, void * data, size_t length)
 	return fwrite(data, length, 1, proc->ctx.backing) == 1? PS_OK : PS_FAIL;
 }
 
-esp_err_t packfs_process_fromfile(const char * filepath, packfs_proccb_t * cbs, void * userdata) {
+esp_err_t packfs_process_fromfile(const char * filepath, size_t chunksize, packfs_proccb_t * cbs, void * userdata) {
 	labels(procerr); // @suppress("Type cannot be resolved")
 
 	// Check args
 	if unlikely(filepath == NULL || cbs == NULL) {
 		return ESP_ERR_INVALID_ARG;
 	}
+	if unlikely(chunksize != 0 && chunksize < PACKFS_PROC_MINCHUNK) {
+		return ESP_ERR_INVALID_SIZE;
+	}
 
 	// Allocate and proc structure
 	pfsp_io_t ios = {
 		.read = pfsp_fromfile_read
 	};
-	pfs_proc_t * proc = pfsp_malloc(userdata, PP_FILE, &ios, cbs, cbs->onbodyhash != NULL || cbs->onimgentryend != NULL, 0);
+	pfs_proc_t * proc = pfsp_malloc(userdata, PP_FILE, &ios, cbs, cbs->onbodyhash != NULL || cbs->onimgentryend != NULL, chunksize, 0);
 	if (proc == NULL) {
 		return ESP_ERR_NO_MEM;
 	}
@@ -562,8 +662,11 @@ esp_err_t packfs_process_fromfile(const char * filepath, packfs_proccb_t * cbs,
 	// Return err
 	esp_err_t err = ESP_OK;
 
-	// Open backing file
-	if ((proc->ctx.backing = fopen(filepath, "r")) == NULL) {
+	// Open backing file through its backend
+	void * ud = NULL;
+	time_t mtime = 0;
+	proc->from.backend = pfs_backendfind(filepath, &ud);
+	if (!proc->from.backend->stat(filepath, ud, &proc->from.length, &mtime) || (proc->from.handle = proc->from.backend->open(filepath, ud)) == NULL) {
 		errgoto(ESP_FAIL, procerr);
 	}
 
@@ -572,9 +675,9 @@ esp_err_t packfs_process_fromfile(const char * filepath, packfs_proccb_t * cbs,
 		err = ESP_FAIL;
 	}
 
-	// Close the spiffs file
-	fclose(proc->ctx.backing);
-	proc->ctx.backing = NULL;
+	// Close the backing file
+	proc->from.backend->close(proc->from.handle);
+	proc->from.handle = NULL;
 
 procerr:
 	pfsp_free(proc);
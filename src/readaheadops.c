@@ -0,0 +1,142 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <esp_log.h>
+
+#include "packfs-priv.h"
+
+#ifndef CONFIG_PACKFS_LZO_READAHEAD
+#error "This file should NOT be included if CONFIG_PACKFS_LZO_READAHEAD is not set."
+#else
+
+// One worker serves every fd with read-ahead on. After an fd loads block N it queues N+1 here,
+// the worker reads and decodes it into the fd's second buffer while the caller consumes N
+
+static pthread_mutex_t aheadlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aheadcond = PTHREAD_COND_INITIALIZER;
+static pfs_ahead_t * aheadqueue = NULL;
+static bool aheadstarted = false;
+
+static bool pfs_aheadfetch(pfs_ahead_t * ahead, uint8_t * scratch) {
+	// Same checks as pfs_readlzoblock, against the snapshot the fd queued
+	size_t lengthsize = pfs_lzolengthsize(ahead->flags);
+	uint32_t compressed_length = 0;
+	if (!pfs_cacheread(ahead->cache, ahead->offset, &compressed_length, lengthsize) || compressed_length > ahead->blocksize) {
+		return false;
+	}
+
+	if (!pfs_cacheread(ahead->cache, ahead->offset + lengthsize, scratch, compressed_length)) {
+		return false;
+	}
+
+	ahead->compressed_length = compressed_length;
+	ahead->nextoffset = ahead->offset + lengthsize + compressed_length;
+	return pfs_lzodecode(ahead->flags, scratch, compressed_length, ahead->buffer, ahead->uncompressed_length);
+}
+
+static void * pfs_aheadworker(void * arg) {
+	uint8_t * scratch = arg;
+
+	pthread_mutex_lock(&aheadlock);
+	while (true) {
+		while (aheadqueue == NULL) {
+			pthread_cond_wait(&aheadcond, &aheadlock);
+		}
+
+		pfs_ahead_t * ahead = aheadqueue;
+		aheadqueue = ahead->next;
+		ahead->next = NULL;
+		ahead->state = PFS_AHEAD_BUSY;
+
+		// Fetch without the lock, owners wait for BUSY to clear before touching the job
+		pthread_mutex_unlock(&aheadlock);
+		bool success = pfs_aheadfetch(ahead, scratch);
+		pthread_mutex_lock(&aheadlock);
+
+		ahead->state = success? PFS_AHEAD_READY : PFS_AHEAD_FAILED;
+		pthread_cond_broadcast(&aheadcond);
+	}
+
+	return NULL;
+}
+
+static bool pfs_aheadstart(void) {
+	if (aheadstarted) {
+		return true;
+	}
+
+	// Worker owns one compressed buffer, shared by every job
+	uint8_t * scratch = malloc(PACKFS_MAX_LZOBLOCK);
+	if (scratch == NULL) {
+		return false;
+	}
+
+	if (!pfs_threadstart(pfs_aheadworker, scratch, "packfs-ahead", CONFIG_PACKFS_LZO_READAHEAD_STACK, CONFIG_PACKFS_LZO_READAHEAD_PRIORITY, CONFIG_PACKFS_LZO_READAHEAD_CORE)) {
+		free(scratch);
+		return false;
+	}
+
+	aheadstarted = true;
+	return true;
+}
+
+bool pfs_aheadqueue(pfs_ahead_t * ahead) {
+	bool success = false;
+
+	pthread_mutex_lock(&aheadlock);
+	{
+		if ((success = pfs_aheadstart())) {
+			// Append so fds are served in the order they asked
+			pfs_ahead_t ** link = &aheadqueue;
+			while (*link != NULL) link = &(*link)->next;
+
+			ahead->next = NULL;
+			ahead->state = PFS_AHEAD_QUEUED;
+			*link = ahead;
+			pthread_cond_broadcast(&aheadcond);
+		}
+	}
+	pthread_mutex_unlock(&aheadlock);
+	return success;
+}
+
+pfs_aheadstate_t pfs_aheadwait(pfs_ahead_t * ahead) {
+	pfs_aheadstate_t state;
+
+	pthread_mutex_lock(&aheadlock);
+	{
+		while (ahead->state == PFS_AHEAD_QUEUED || ahead->state == PFS_AHEAD_BUSY) {
+			pthread_cond_wait(&aheadcond, &aheadlock);
+		}
+		state = ahead->state;
+	}
+	pthread_mutex_unlock(&aheadlock);
+	return state;
+}
+
+void pfs_aheadcancel(pfs_ahead_t * ahead) {
+	pthread_mutex_lock(&aheadlock);
+	{
+		if (ahead->state == PFS_AHEAD_QUEUED) {
+			// Not picked up yet, just drop it from the queue
+			for (pfs_ahead_t ** link = &aheadqueue; *link != NULL; link = &(*link)->next) {
+				if (*link == ahead) {
+					*link = ahead->next;
+					break;
+				}
+			}
+			ahead->next = NULL;
+		}
+
+		// Worker is reading into our buffer, let it finish
+		while (ahead->state == PFS_AHEAD_BUSY) {
+			pthread_cond_wait(&aheadcond, &aheadlock);
+		}
+		ahead->state = PFS_AHEAD_IDLE;
+	}
+	pthread_mutex_unlock(&aheadlock);
+}
+
+#endif
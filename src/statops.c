@@ -8,6 +8,8 @@
 
 #include "packfs-priv.h"
 
+extern const char * pprefix_path;
+
 int pfs_fstat(int fd, struct stat * st) {
 	pfs_ctx_t * ctx = pfs_getctx(fd);
 
@@ -21,17 +23,24 @@ int pfs_fstat(int fd, struct stat * st) {
 }
 
 int pfs_stat(const char * path, struct stat * st) {
-	int fd = pfs_open(path, O_RDONLY, 0);
-	if (fd == -1) {
+	// Sanity check args
+	if unlikely(path == NULL) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	int save_ret = pfs_fstat(fd, st);
-	error_t save_errno = errno;
-	pfs_close(fd);
+	// Get path within pack file
+	char rootpath[PACKFS_MAX_FULLPATH] = {0};
+	size_t prefixlen = strlcpy(rootpath, pprefix_path, sizeof(rootpath));
+	const char * subpath = pfs_parsepath(path, &rootpath[prefixlen], sizeof(rootpath) - prefixlen);
+
+	// Check for successful parse
+	if (rootpath[0] == '\0') {
+		errno = ENOENT;
+		return -1;
+	}
 
-	errno = save_errno;
-	return save_ret;
+	return xfs_stat(rootpath, subpath, st);
 }
 
 int pfs_access(const char * path, int amode) {
@@ -83,3 +92,97 @@ int xfs_fstat(pfs_ctx_t * ctx, struct stat * st) {
 
 	return 0;
 }
+
+#ifdef CONFIG_PACKFS_LZO_SUPPORT
+static bool pfs_statlzoheader(pfs_cache_t * cache, packfs_entry_t * entry, pfs_lzoheader_t * header) {
+	// Pack has no size table, read the header straight from the backing file
+	memset(header, 0, sizeof(pfs_lzoheader_t));
+	return pfs_cacheopen(cache) && pfs_cacheread(cache, entry->offset, header, pfs_lzoheadersize(entry->flags)) && header->blocksize > 0;
+}
+#endif
+
+int xfs_stat(const char * backingpath, const char * subpath, struct stat * st) {
+	labels(staterr); // @suppress("Type cannot be resolved")
+
+	// Get the parsed header and index, errno is set on failure
+	pfs_cache_t * cache = pfs_cacheget(backingpath);
+	if (cache == NULL) {
+		return -1;
+	}
+
+	uint32_t index = 0;
+	packfs_entry_t entry;
+	if (subpath != NULL && pfs_findindex(cache, subpath, &index)) {
+		// Regular entry, answered from the index
+		if (!pfs_readindex(cache, index, &entry)) {
+			errnogoto(EIO, staterr);
+		}
+
+		if ((entry.offset + entry.length) > cache->length) {
+			// Entry is passed file bounds, pack file probably stripped
+			errnogoto(ENOENT, staterr);
+		}
+
+		if (st != NULL) {
+			memset(st, 0, sizeof(struct stat));
+			st->st_mode = S_IRUSR | S_IRGRP | S_IROTH | S_IFREG;
+			st->st_mtime = st->st_atime = st->st_ctime = 0;
+
+			if (cache->sizes != NULL && cache->sizes[index].blocksize > 0) {
+				// Compressed file, sizes recorded at build time
+				st->st_size = cache->sizes[index].size;
+				st->st_blksize = cache->sizes[index].blocksize;
+				st->st_blocks = (st->st_size + st->st_blksize - 1) / st->st_blksize;
+
+			} else if (entry.flags & PF_LZO) {
+				// Compressed file
+#ifdef CONFIG_PACKFS_LZO_SUPPORT
+				pfs_lzoheader_t header;
+				if (!pfs_statlzoheader(cache, &entry, &header)) {
+					errnogoto(EIO, staterr);
+				}
+
+				st->st_size = header.uncompressed_length;
+				st->st_blksize = header.blocksize;
+				st->st_blocks = (header.uncompressed_length + header.blocksize - 1) / header.blocksize;
+#else
+				st->st_size = 0;
+				st->st_blksize = 1;
+				st->st_blocks = 0;
+#endif
+			} else {
+				// Regular file
+				st->st_size = entry.length;
+				st->st_blksize = 1;
+				st->st_blocks = st->st_size;
+			}
+		}
+
+	} else {
+		// Not an entry, check for a directory
+		char prefix[PACKFS_MAX_INDEXPATH];
+		size_t prefixlen = 0;
+		if (!pfs_dirprefix(subpath, prefix, sizeof(prefix), &prefixlen)) {
+			errnogoto(ENAMETOOLONG, staterr);
+		}
+
+		uint32_t first = 0, end = 0;
+		if (!pfs_finddir(cache, prefix, prefixlen, &first, &end)) {
+			errnogoto(ENOENT, staterr);
+		}
+
+		if (st != NULL) {
+			memset(st, 0, sizeof(struct stat));
+			st->st_mode = S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH | S_IFDIR;
+			st->st_mtime = st->st_atime = st->st_ctime = 0;
+			st->st_blksize = 1;
+		}
+	}
+
+	pfs_cacheput(cache);
+	return 0;
+
+staterr:
+	pfs_cacheput(cache);
+	return -1;
+}
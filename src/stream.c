@@ -16,14 +16,17 @@ void * pfss_extra(pfs_stream_t * stream) {
 	return stream != NULL? &stream->buffer[stream->size] : NULL;
 }
 
-pfs_proc_t * pfss_create(size_t buffersize, pfsp_io_t * ios, packfs_proccb_t * cbs, void * userdata, size_t extrasize) {
+pfs_proc_t * pfss_create(size_t buffersize, size_t chunksize, pfsp_io_t * ios, packfs_proccb_t * cbs, void * userdata, size_t extrasize) {
 	// Sanity check args
 	if unlikely(buffersize < PACKFS_MIN_STREAMSIZE) {
 		return NULL;
 	}
 
+	// Reads never return more than the stream buffer holds, don't allocate past it
+	chunksize = min(chunksize != 0? chunksize : PACKFS_PROC_BUFSIZE, buffersize);
+
 	// Allocate and set up proc + stream
-	pfs_proc_t * proc = pfsp_malloc(userdata, PP_STREAM, ios, cbs, cbs->onbodyhash != NULL || cbs->onimgentryend != NULL, sizeof(pfs_stream_t) + buffersize + extrasize);
+	pfs_proc_t * proc = pfsp_malloc(userdata, PP_STREAM, ios, cbs, cbs->onbodyhash != NULL || cbs->onimgentryend != NULL, chunksize, sizeof(pfs_stream_t) + buffersize + extrasize);
 	pfs_stream_t * stream = pfsp_extra(proc);
 	if (proc == NULL || stream == NULL) {
 		return NULL;
@@ -66,6 +69,62 @@ packfs_status_t pfss_read(pfs_proc_t * proc, void * data, size_t minlength, size
 	}
 }
 
+packfs_status_t pfss_span(pfs_proc_t * proc, size_t maxlength, void ** outdata, size_t * outlength) {
+	pfs_stream_t * stream = pfsp_extra(proc);
+
+	if (stream->offset == 0 && stream->eof) {
+		return PS_EOF;
+
+	} else if (stream->length == 0) {
+		return PS_AGAIN;
+
+	} else {
+		// Up to the end of the ring, the wrapped part comes on the next call
+		size_t bytes = min(min(stream->length, maxlength), stream->size - stream->offset);
+		*outdata = &stream->buffer[stream->offset];
+
+		// Bytes stay put until the next load, which the caller can't do while processing
+		stream->offset = (stream->offset + bytes) % stream->size;
+		stream->length -= bytes;
+		*outlength = bytes;
+		return PS_OK;
+	}
+}
+
+static inline size_t pfss_free(pfs_stream_t * stream) {
+	// Contiguous free space from the write position to the end of the ring or the read position
+	size_t start = (stream->offset + stream->length) % stream->size;
+	return min(stream->size - stream->length, stream->size - start);
+}
+
+packfs_status_t packfs_stream_reserve(packfs_stream_t stream, void ** out_data, size_t * out_length) {
+	pfs_proc_t * proc = (pfs_proc_t *)stream;
+	pfs_stream_t * extra = NULL;
+
+	// Sanity check
+	if unlikely(proc == NULL || proc->type != PP_STREAM || out_data == NULL || out_length == NULL || (extra = pfsp_extra(proc)) == NULL) {
+		return PS_FAIL;
+	}
+
+	// Nothing can go in after eof, a full ring gives a zero length span
+	*out_data = &extra->buffer[(extra->offset + extra->length) % extra->size];
+	*out_length = extra->eof? 0 : pfss_free(extra);
+	return PS_OK;
+}
+
+packfs_status_t packfs_stream_commit(packfs_stream_t stream, size_t length) {
+	pfs_proc_t * proc = (pfs_proc_t *)stream;
+	pfs_stream_t * extra = NULL;
+
+	// Sanity check, can't commit more than the last reserve handed out
+	if unlikely(proc == NULL || proc->type != PP_STREAM || (extra = pfsp_extra(proc)) == NULL || extra->eof || length > pfss_free(extra)) {
+		return PS_FAIL;
+	}
+
+	extra->length += length;
+	return PS_OK;
+}
+
 ssize_t packfs_stream_load(packfs_stream_t stream, void * data, size_t length) {
 	pfs_proc_t * proc = (pfs_proc_t *)stream;
 	pfs_stream_t * extra = NULL;
@@ -189,20 +248,21 @@ packfs_status_t packfs_stream_loadeofandflush(packfs_stream_t stream) {
 }
 
 
-esp_err_t packfs_stream_tofile(FILE * fp, size_t bufsize, packfs_proccb_t * cbs, void * userdata, packfs_stream_t * out_stream) {
+esp_err_t packfs_stream_tofile(FILE * fp, size_t bufsize, size_t chunksize, packfs_proccb_t * cbs, void * userdata, packfs_stream_t * out_stream) {
 	if unlikely(fp == NULL || cbs == NULL || out_stream == NULL) {
 		return ESP_ERR_INVALID_ARG;
 	}
-	if unlikely(bufsize < PACKFS_MIN_STREAMSIZE) {
+	if unlikely(bufsize < PACKFS_MIN_STREAMSIZE || (chunksize != 0 && chunksize < PACKFS_PROC_MINCHUNK)) {
 		return ESP_ERR_INVALID_SIZE;
 	}
 
 	// Allocate and proc structure
 	pfsp_io_t ios = {
 		.read = pfss_read,
-		.write = pfsp_tofile_write
+		.write = pfsp_tofile_write,
+		.span = pfss_span
 	};
-	pfs_proc_t * proc = pfss_create(bufsize, &ios, cbs, userdata, 0);
+	pfs_proc_t * proc = pfss_create(bufsize, chunksize, &ios, cbs, userdata, 0);
 	if (proc == NULL) {
 		return ESP_ERR_NO_MEM;
 	}
@@ -0,0 +1,66 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#ifndef CONFIG_IDF_TARGET_LINUX
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+#include <esp_log.h>
+
+#include "packfs-priv.h"
+
+// Workers get their name, stack, priority and core at creation. Going through esp_pthread_set_cfg
+// instead would leave a config behind on the calling task, there is no way to clear one
+
+#ifdef CONFIG_IDF_TARGET_LINUX
+bool pfs_threadstart(pfs_threadfn_t fn, void * arg, const char * name, uint32_t stacksize, unsigned int priority, int core) {
+	// Plain pthread with the host's default stack, priority and core don't apply
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_t thread;
+	int err = pthread_create(&thread, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+
+	if (err != 0) {
+		ESP_LOGE(PACKFS_TAG, "Failed to start %s: err=%d", name, err);
+		return false;
+	}
+
+	return true;
+}
+
+#else
+typedef struct {
+	pfs_threadfn_t fn;
+	void * arg;
+} pfs_threadarg_t;
+
+static void pfs_threadrun(void * arg) {
+	pfs_threadarg_t start = *(pfs_threadarg_t *)arg;
+	free(arg);
+
+	// Tasks must not return
+	start.fn(start.arg);
+	vTaskDelete(NULL);
+}
+
+bool pfs_threadstart(pfs_threadfn_t fn, void * arg, const char * name, uint32_t stacksize, unsigned int priority, int core) {
+	pfs_threadarg_t * start = malloc(sizeof(pfs_threadarg_t));
+	if (start == NULL) {
+		return false;
+	}
+	start->fn = fn;
+	start->arg = arg;
+
+	if (xTaskCreatePinnedToCore(pfs_threadrun, name, stacksize, start, priority, NULL, (core == PACKFS_NOAFFINITY)? tskNO_AFFINITY : core) != pdPASS) {
+		ESP_LOGE(PACKFS_TAG, "Failed to start %s", name);
+		free(start);
+		return false;
+	}
+
+	return true;
+}
+#endif
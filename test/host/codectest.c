@@ -0,0 +1,126 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packfs-priv.h"
+
+// Decodes blocks written by roundtrip.py, each record is
+//   uint8_t flags, uint32_t blocksize, uint32_t uncompressed_length, uint32_t compressed_length,
+//   uint32_t crc32 of the uncompressed block, compressed block
+// Every block is decoded into a separate buffer and then in place, from the tail of a
+// blocksize + PACKFS_INPLACE_MARGIN buffer the way CONFIG_PACKFS_LZO_INPLACE reads it
+
+typedef struct __packfs_packed {
+	uint8_t flags;
+	uint32_t blocksize;
+	uint32_t uncompressed_length;
+	uint32_t compressed_length;
+	uint32_t crc;
+} codectest_record_t;
+
+static bool codectest_decode(const pfs_codec_t * codec, const uint8_t * in, size_t inlen, uint8_t * out, uint32_t crc, size_t length) {
+	size_t len = length;
+	if (!codec->decode(in, inlen, out, &len)) {
+		printf("  decode failed\n");
+		return false;
+	}
+
+	if (len != length) {
+		printf("  decoded %zu bytes, expected %zu\n", len, length);
+		return false;
+	}
+
+	if (crc32_le(0, out, length) != crc) {
+		printf("  decoded data differs\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool codectest_record(const codectest_record_t * record, const uint8_t * compressed) {
+	const pfs_codec_t * codec = pfs_codecfind(record->flags);
+	if (codec == NULL) {
+		printf("  no codec for flags 0x%02x\n", record->flags);
+		return false;
+	}
+
+	if (record->compressed_length >= record->uncompressed_length || record->uncompressed_length > record->blocksize) {
+		printf("  bad record: %u -> %u bytes, blocksize %u\n", record->compressed_length, record->uncompressed_length, record->blocksize);
+		return false;
+	}
+
+	bool success = false;
+	size_t size = (size_t)record->blocksize + PACKFS_INPLACE_MARGIN(record->blocksize);
+	uint8_t * out = malloc(record->blocksize);
+	uint8_t * inplace = malloc(size);
+	if (out == NULL || inplace == NULL) {
+		printf("  out of memory\n");
+		goto end;
+	}
+
+	// Separate buffers
+	if (!codectest_decode(codec, compressed, record->compressed_length, out, record->crc, record->uncompressed_length)) {
+		printf("  %s, separate buffers\n", codec->name);
+		goto end;
+	}
+
+	// Compressed block at the tail, decoded toward the head
+	uint8_t * in = &inplace[size - record->compressed_length];
+	memcpy(in, compressed, record->compressed_length);
+	if (!codectest_decode(codec, in, record->compressed_length, inplace, record->crc, record->uncompressed_length)) {
+		printf("  %s, in place\n", codec->name);
+		goto end;
+	}
+
+	success = true;
+
+end:
+	free(out);
+	free(inplace);
+	return success;
+}
+
+int main(int argc, char ** argv) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <fixture>\n", argv[0]);
+		return 2;
+	}
+
+	FILE * fp = fopen(argv[1], "rb");
+	if (fp == NULL) {
+		perror(argv[1]);
+		return 2;
+	}
+
+	if (!pfs_initcodecs()) {
+		printf("Codec init failed\n");
+		fclose(fp);
+		return 1;
+	}
+
+	unsigned int total = 0, failed = 0;
+	codectest_record_t record;
+	while (fread(&record, sizeof(record), 1, fp) == 1) {
+		uint8_t * compressed = malloc(record.compressed_length);
+		if (compressed == NULL || fread(compressed, 1, record.compressed_length, fp) != record.compressed_length) {
+			printf("Truncated fixture at record %u\n", total);
+			free(compressed);
+			fclose(fp);
+			return 1;
+		}
+
+		if (!codectest_record(&record, compressed)) {
+			printf("Record %u failed: flags=0x%02x blocksize=%u %u -> %u bytes\n", total, record.flags, record.blocksize, record.compressed_length, record.uncompressed_length);
+			failed += 1;
+		}
+
+		total += 1;
+		free(compressed);
+	}
+	fclose(fp);
+
+	printf("%u blocks, %u failed\n", total, failed);
+	return (total == 0 || failed > 0)? 1 : 0;
+}
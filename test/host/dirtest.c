@@ -0,0 +1,113 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "packfs-priv.h"
+
+// Lists and stats directories in the fixture packs the way packfs and imagefs mounts do.
+// rooted.pack stores imagefs style paths ("/app.bin", "/sub/a.txt"), ifs_opendir and ifs_stat
+// hand the VFS path through as is. plain.pack stores packfs style paths ("sub/b.txt"). Both
+// were built with packfs.py
+
+static char fixtures[PACKFS_MAX_FULLPATH];
+static unsigned int failed = 0;
+
+static void dirtest_path(char * path, size_t pathlen, const char * pack) {
+	snprintf(path, pathlen, "%s/%s", fixtures, pack);
+}
+
+// Directories are listed with a trailing '/', separated by spaces, or "errno=N" on failure
+static void dirtest_list(const char * pack, const char * subpath, const char * expected) {
+	char path[PACKFS_MAX_FULLPATH], listing[512] = {0};
+	dirtest_path(path, sizeof(path), pack);
+
+	pfs_ctx_t ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	pfs_dirent_t * dir = xfs_opendir(&ctx, path, subpath, 0);
+	if (dir == NULL) {
+		snprintf(listing, sizeof(listing), "errno=%d", errno);
+
+	} else {
+		struct dirent * out = NULL;
+		while (xfs_readdir_r(&ctx, dir, &dir->ent, &out) == 0 && out != NULL) {
+			if (listing[0] != '\0') strlcat(listing, " ", sizeof(listing));
+			strlcat(listing, out->d_name, sizeof(listing));
+			if (out->d_type == DT_DIR) strlcat(listing, "/", sizeof(listing));
+		}
+		xfs_close(&ctx);
+		free(dir);
+	}
+
+	bool ok = strcmp(listing, expected) == 0;
+	printf("%s list %s#%s: %s\n", ok? "ok  " : "FAIL", pack, subpath != NULL? subpath : "(null)", listing);
+	if (!ok) {
+		printf("     expected: %s\n", expected);
+		failed += 1;
+	}
+}
+
+// Reports "dir", "reg" or "errno=N"
+static void dirtest_stat(const char * pack, const char * subpath, const char * expected) {
+	char path[PACKFS_MAX_FULLPATH], result[32];
+	dirtest_path(path, sizeof(path), pack);
+
+	struct stat st;
+	if (xfs_stat(path, subpath, &st) != 0) {
+		snprintf(result, sizeof(result), "errno=%d", errno);
+	} else {
+		snprintf(result, sizeof(result), "%s", S_ISDIR(st.st_mode)? "dir" : "reg");
+	}
+
+	bool ok = strcmp(result, expected) == 0;
+	printf("%s stat %s#%s: %s\n", ok? "ok  " : "FAIL", pack, subpath != NULL? subpath : "(null)", result);
+	if (!ok) {
+		printf("     expected: %s\n", expected);
+		failed += 1;
+	}
+}
+
+int main(int argc, char ** argv) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <fixtures>\n", argv[0]);
+		return 2;
+	}
+	strlcpy(fixtures, argv[1], sizeof(fixtures));
+
+	char enoent[16], enotdir[16];
+	snprintf(enoent, sizeof(enoent), "errno=%d", ENOENT);
+	snprintf(enotdir, sizeof(enotdir), "errno=%d", ENOTDIR);
+
+	// Rooted names, as imagefs sees them
+	dirtest_list("rooted.pack", "/", "app.bin readme.txt sub/ sub2/");
+	dirtest_list("rooted.pack", "", "app.bin readme.txt sub/ sub2/");
+	dirtest_list("rooted.pack", NULL, "app.bin readme.txt sub/ sub2/");
+	dirtest_list("rooted.pack", "/sub", "a.txt deep/");
+	dirtest_list("rooted.pack", "/sub/", "a.txt deep/");
+	dirtest_list("rooted.pack", "/sub/deep", "b.txt");
+	dirtest_list("rooted.pack", "/sub2", "c.txt");
+	dirtest_list("rooted.pack", "/nope", enoent);
+	dirtest_list("rooted.pack", "/readme.txt", enotdir);
+
+	dirtest_stat("rooted.pack", "/", "dir");
+	dirtest_stat("rooted.pack", "/sub", "dir");
+	dirtest_stat("rooted.pack", "/sub/deep/", "dir");
+	dirtest_stat("rooted.pack", "/sub/a.txt", "reg");
+	dirtest_stat("rooted.pack", "/app.bin", "reg");
+	dirtest_stat("rooted.pack", "/nope", enoent);
+	dirtest_stat("rooted.pack", "/su", enoent);
+
+	// Relative names, as packfs sees them after the '#'
+	dirtest_list("plain.pack", NULL, "a.txt sub/");
+	dirtest_list("plain.pack", "/", "a.txt sub/");
+	dirtest_list("plain.pack", "sub", "b.txt");
+	dirtest_list("plain.pack", "a.txt", enotdir);
+
+	dirtest_stat("plain.pack", "sub", "dir");
+	dirtest_stat("plain.pack", "sub/b.txt", "reg");
+	dirtest_stat("plain.pack", "nope", enoent);
+
+	printf("%u failed\n", failed);
+	return failed > 0? 1 : 0;
+}
@@ -0,0 +1,112 @@
+from argparse import ArgumentParser
+from contextlib import redirect_stdout
+from importlib import import_module
+from io import StringIO
+from random import Random
+from struct import pack, unpack_from, calcsize
+from subprocess import call
+from zlib import crc32
+import sys
+
+# Builds compressed entries with packfs.py and writes every compressed block to a fixture for
+# codectest, so the builder's encoders are checked against the reader's decoders. Exits 77
+# (skipped) when the codec's python module isn't installed. With --sample only a few blocks of
+# each kind are written, that's how fixtures/<codec>.bin are regenerated
+
+SKIP = 77
+MODULES = {'lzo': 'lzo', 'lz4': 'lz4.block', 'heatshrink': 'heatshrink2'}
+BLOCKSIZES = [256, 2048, 4096, 70000]
+
+# Committed fixtures: short and long blocks, barely compressible ones that leave the in-place
+# decode the least room, partial tails and PF_LZOWIDE blocks
+SAMPLES = [('text', 256), ('runs', 2048), ('mixed', 4096), ('dense', 256), ('dense', 4096), ('tail', 4096), ('pattern', 70000), ('tail', 70000)]
+SAMPLEBLOCKS = 2
+
+
+def datasets():
+    rng = Random(0x12fc)
+    words = [b'packfs', b'block', b'entry', b'index', b'flash', b'the', b'a', b'of', b'\n', b'    ']
+    text = b' '.join(rng.choice(words) for _ in range(40000))
+    mixed = b''.join(rng.randbytes(rng.randrange(1, 64)) + bytes([rng.randrange(256)]) * rng.randrange(1, 300) for _ in range(2000))
+    return {
+        'zeros': bytes(150000),
+        # Period 1 to 3 repeats use the nearest backreferences, heatshrink window value 0
+        'runs': b''.join(bytes([i & 0xff]) * (i % 3 + 1) * 37 for i in range(3000)),
+        'pattern': b'ab' * 30000 + b'abc' * 20000,
+        'text': text,
+        'mixed': mixed,
+        'random': rng.randbytes(20000),
+        'tail': text[:5000] + bytes(777),
+        # Barely compressible, the in-place decode's output runs closest to its input
+        'dense': b''.join(rng.randbytes(48) + bytes(16) for _ in range(1000)),
+    }
+
+
+def blocks(packfs, blocksize, data, codec):
+    # Walk the entry the way the reader does, through the block offset table
+    with redirect_stdout(StringIO()):
+        entry = packfs.mklzoentry(blocksize, data, codec)
+
+    wide = packfs.lzowide(blocksize)
+    headfmt, lenfmt = ('<II', '<I') if wide else ('<IH', '<H')
+    length, bs = unpack_from(headfmt, entry)
+    assert length == len(data) and bs == blocksize
+
+    numblocks = (length + blocksize - 1) // blocksize
+    table = unpack_from('<{}I'.format(numblocks), entry, calcsize(headfmt))
+    flags = codec | packfs.PF_LZO | packfs.PF_LZOTABLE | (packfs.PF_LZOWIDE if wide else 0)
+    for i, offset in enumerate(table):
+        clen, = unpack_from(lenfmt, entry, offset)
+        offset += calcsize(lenfmt)
+        expected = data[i * blocksize:(i + 1) * blocksize]
+        yield flags, entry[offset:offset + clen], expected
+
+
+def main():
+    parser = ArgumentParser(description='Round-trip packfs.py blocks through the packfs codecs')
+    parser.add_argument('--packfs', required=True, help='Directory holding packfs.py')
+    parser.add_argument('--codec', required=True, choices=MODULES.keys())
+    parser.add_argument('--fixture', required=True, help='Fixture file to write')
+    parser.add_argument('--sample', action='store_true', help='Only write a few blocks of each kind')
+    parser.add_argument('codectest', nargs='?', help='codectest binary, run on the fixture when given')
+    args = parser.parse_args()
+
+    try:
+        import_module('lzo')
+        import_module(MODULES[args.codec])
+    except ImportError as e:
+        print('Skipping {}: {}'.format(args.codec, e))
+        return SKIP
+
+    sys.path.insert(0, args.packfs)
+    packfs = import_module('packfs')
+    codec = {'lzo': packfs.PF_CODEC_LZO, 'lz4': packfs.PF_CODEC_LZ4, 'heatshrink': packfs.PF_CODEC_HEATSHRINK}[args.codec]
+
+    data = datasets()
+    runs = SAMPLES if args.sample else [(name, blocksize) for name in data for blocksize in BLOCKSIZES]
+    compressed = stored = 0
+    with open(args.fixture, 'wb') as fixture:
+        for name, blocksize in runs:
+            written = 0
+            for flags, block, expected in blocks(packfs, blocksize, data[name], codec):
+                # Stored blocks are copied, never decoded
+                if len(block) == len(expected):
+                    stored += 1
+                    continue
+
+                # Samples keep the first blocks and the partial tail
+                last = len(expected) < blocksize
+                if args.sample and written >= SAMPLEBLOCKS and not last:
+                    continue
+
+                fixture.write(pack('<BIIII', flags, blocksize, len(expected), len(block), crc32(expected) & 0xffffffff) + block)
+                compressed += 1
+                written += 1
+
+    print('{}: {} compressed blocks, {} stored'.format(args.codec, compressed, stored))
+    sys.stdout.flush()
+    return call([args.codectest, args.fixture]) if args.codectest else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
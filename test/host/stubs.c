@@ -0,0 +1,51 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <sys/lock.h>
+#include <rom/crc.h>
+#include <esp_vfs.h>
+
+// Host versions of the IDF and newlib functions the pack readers call
+
+static pthread_mutex_t locks = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+void _lock_init(_lock_t * lock) { (void)lock; }
+void _lock_acquire(_lock_t * lock) { (void)lock; pthread_mutex_lock(&locks); }
+void _lock_release(_lock_t * lock) { (void)lock; pthread_mutex_unlock(&locks); }
+void _lock_close(_lock_t * lock) { (void)lock; }
+
+uint32_t crc32_le(uint32_t crc, const uint8_t * buf, uint32_t len) {
+	crc = ~crc;
+	for (uint32_t i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (unsigned int b = 0; b < 8; b++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+esp_err_t esp_vfs_register(const char * base_path, const esp_vfs_t * vfs, void * ctx) {
+	(void)base_path;
+	(void)vfs;
+	(void)ctx;
+	return ESP_OK;
+}
+
+#if !defined(__GLIBC__) || __GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38)
+size_t strlcpy(char * dst, const char * src, size_t size) {
+	size_t length = strlen(src);
+	if (size > 0) {
+		size_t copy = length < size? length : size - 1;
+		memcpy(dst, src, copy);
+		dst[copy] = '\0';
+	}
+	return length;
+}
+
+size_t strlcat(char * dst, const char * src, size_t size) {
+	size_t length = strnlen(dst, size);
+	return length + strlcpy(&dst[length], src, size - length);
+}
+#endif
@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+
+// The IDF's DIR is a complete type that packfs embeds, glibc's is opaque
+
+typedef struct {
+	uint16_t dd_vfs_idx;
+	uint16_t dd_rsv;
+} DIR;
+
+struct dirent {
+	int d_ino;
+	uint8_t d_type;
+	char d_name[256];
+};
+
+#define DT_UNKNOWN	(0)
+#define DT_REG		(1)
+#define DT_DIR		(2)
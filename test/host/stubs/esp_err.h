@@ -0,0 +1,13 @@
+#pragma once
+// Host stand-ins for the IDF headers packfs-priv.h pulls in, enough to build the codecs
+
+typedef int esp_err_t;
+
+#define ESP_OK					(0)
+#define ESP_FAIL				(-1)
+#define ESP_ERR_NO_MEM			(0x101)
+#define ESP_ERR_INVALID_ARG		(0x102)
+#define ESP_ERR_INVALID_STATE	(0x103)
+#define ESP_ERR_INVALID_SIZE	(0x104)
+#define ESP_ERR_NOT_FOUND		(0x105)
+#define ESP_ERR_NOT_SUPPORTED	(0x106)
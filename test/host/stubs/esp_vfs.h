@@ -0,0 +1,29 @@
+#pragma once
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <esp_err.h>
+
+#define ESP_VFS_FLAG_DEFAULT	(0)
+
+typedef struct {
+	int flags;
+	int (*open)(const char * path, int flags, int mode);
+	int (*close)(int fd);
+	ssize_t (*read)(int fd, void * dst, size_t size);
+	ssize_t (*write)(int fd, const void * data, size_t size);
+	off_t (*lseek)(int fd, off_t size, int mode);
+	int (*ioctl)(int fd, int cmd, va_list args);
+	int (*fstat)(int fd, struct stat * st);
+	int (*stat)(const char * path, struct stat * st);
+	DIR * (*opendir)(const char * name);
+	struct dirent * (*readdir)(DIR * pdir);
+	int (*readdir_r)(DIR * pdir, struct dirent * entry, struct dirent ** out_dirent);
+	long (*telldir)(DIR * pdir);
+	void (*seekdir)(DIR * pdir, long offset);
+	int (*closedir)(DIR * pdir);
+	int (*access)(const char * path, int amode);
+} esp_vfs_t;
+
+esp_err_t esp_vfs_register(const char * base_path, const esp_vfs_t * vfs, void * ctx);
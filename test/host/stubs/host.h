@@ -0,0 +1,19 @@
+#pragma once
+// Forced into every host build, covers what newlib and the IDF provide implicitly
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+
+#ifndef EFTYPE
+#define EFTYPE	(79)
+#endif
+
+typedef int error_t;
+
+#if !defined(__GLIBC__) || __GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38)
+size_t strlcpy(char * dst, const char * src, size_t size);
+size_t strlcat(char * dst, const char * src, size_t size);
+#endif
@@ -0,0 +1,5 @@
+#pragma once
+
+typedef struct {
+	int unused;
+} mbedtls_sha256_context;